@@ -1,3 +1,5 @@
+#define  _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>     /* core functions */
 #include <unistd.h>     /* POSIX API (fork/exec, etc) */
@@ -8,29 +10,175 @@
 #include <string.h>     /* basic string functions */
 #include <sys/stat.h>   /* inode manipulation (needed for umask()) */
 #include <sys/wait.h>   /* for waitpid() and friends on linux */
+#include <sys/epoll.h>  /* EPOLLIN */
 
 #include "background.h"
+#include "config.h"
+#include "watchdog.h"
+#include "coroutine.h"
+#include "sdnotify.h"
+#include "startup.h"
+#include "functrace.h"
 
 #include "logging.h"    /* our logging support */
 
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kStatsIntervalMs    (5 * 60 * 1000)     /* how often to log the watchdog, coroutine & function trace counters */
+
+/* set by backgroundStop, which also writes to the pipe so the scheduler wakes up to notice */
+static volatile sig_atomic_t    gStopping = 0;
+static int                      gStopPipe[2] = { -1, -1 };
+
 /*
-    This is the 'main' for the background processing
+    Goes round once per tick, bumping the watchdog's heartbeat. While it
+    keeps going, so does the scheduler.
  */
-int background(void)
+static void heartbeat(void * UNUSED(context))
 {
+    const kConfigurationOptions *options;
+    int                          timeout;
+    int                          systemdWatchdog;
+
+    /* the scheduler's going round, so we're open for business */
+    startupPhase( "scheduler" );
+    startupReady();
+
+    systemdWatchdog = sdWatchdogInterval();
 
-    /* Block and wait for signals.
-     *
-     * An alternate, synchronous strategy to SIGCHLD could be deployed here,
-     * which is to call waitpid(..., WNOHANG) in a loop
-     */
     while (1)
     {
+        watchdogHeartbeat();
+        if ( systemdWatchdog != 0 )
+        {
+            sdNotifyWatchdog();
+        }
+        logShedPoll();
+
         logInfo("zzzz...");
         logError(":: yawn ::");
-        sleep(2);
-    };
 
+        /* wake often enough that an idle loop doesn't look like a stalled one */
+        options = configAcquire();
+        timeout = options->tick;
+        if ( options->watchdog != 0 && options->watchdog / 2 < timeout )
+        {
+            timeout = options->watchdog / 2;
+        }
+        configRelease();
+
+        /* and often enough to keep systemd's watchdog happy, if it has one on us */
+        if ( systemdWatchdog != 0 && systemdWatchdog / 4 < timeout )
+        {
+            timeout = systemdWatchdog / 4;
+        }
+
+        coroutineSleep( timeout );
+    }
+}
+
+/* reload the configuration when the file changes, or on SIGHUP */
+static void reloader(void * UNUSED(context))
+{
+    int     watchFd;
+
+    watchFd = configWatch();
+    if ( watchFd < 0 )
+    {
+        return;
+    }
+
+    while (1)
+    {
+        if ( coroutineAwaitFd( watchFd, EPOLLIN, -1 ) > 0 && configChanged( watchFd ) )
+        {
+            reloadConfiguration();
+        }
+    }
+}
+
+/* just there so the scheduler wakes when backgroundStop is called - the loop in background() does the stopping */
+static void stopper(void * UNUSED(context))
+{
+    char    drain[16];
+
+    while (1)
+    {
+        if ( coroutineAwaitFd( gStopPipe[0], EPOLLIN, -1 ) > 0 )
+        {
+            while ( read( gStopPipe[0], drain, sizeof(drain) ) > 0 )
+            { /* empty it */ }
+        }
+    }
+}
+
+void backgroundStop(void)
+{
+    int     saved;
+
+    gStopping = 1;
+    if ( gStopPipe[1] >= 0 )
+    {
+        saved = errno;
+        (void)write( gStopPipe[1], "", 1 );
+        errno = saved;
+    }
+}
+
+/* log the counters we keep for tuning, every so often */
+static void statistics(void * UNUSED(context))
+{
+    while (1)
+    {
+        coroutineSleep( kStatsIntervalMs );
+
+        watchdogLogStalls();
+        coroutineLogStats();
+        functionTraceLogStats();
+    }
+}
+
+/*
+    This is the 'main' for the background processing
+ */
+int background(void)
+{
+    if ( coroutineInit( 0 ) != 0 )
+    {
+        return -1;
+    }
+
+    if ( pipe2( gStopPipe, O_NONBLOCK | O_CLOEXEC ) != 0 )
+    {
+        logError("unable to create the stop pipe (%s [%d])", strerror(errno), errno);
+        return -1;
+    }
+
+    if ( coroutineSpawn( "heartbeat", heartbeat, NULL ) == NULL
+      || coroutineSpawn( "reloader", reloader, NULL ) == NULL
+      || coroutineSpawn( "statistics", statistics, NULL ) == NULL
+      || coroutineSpawn( "stopper", stopper, NULL ) == NULL )
+    {
+        logError("unable to start the background coroutines");
+        return -1;
+    }
+
+    /* complain, with a stack trace, if the scheduler stops going around */
+    watchdogStart();
+    startupPhase( "background" );
+
+    /* the coroutines never finish, so go round until we're asked to stop */
+    while ( !gStopping && coroutineRun( -1 ) > 0 )
+    { /* until there's nothing left to do */ }
+
+    logInfo("stopping the background loop");
     return 0;
 }
 
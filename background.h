@@ -3,4 +3,7 @@
 
 int     background(void);
 
+/* ask background() to stop its loop and return. Safe to call from a signal handler */
+void    backgroundStop(void);
+
 #endif //BACKGROUND_H
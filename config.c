@@ -1,25 +1,89 @@
+#define  _GNU_SOURCE  /* pipe2 is a linux extension */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <popt.h>       /* popt library for parsing config files and command line options */
 
 #include "common.h"
 #include "config.h"
+#include "logring.h"
+#include "functrace.h"
 
 #include "logging.h"
 
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kDefaultConfigFile  "/etc/toggled.conf"
+
+/* maximum number of threads that may read the configuration concurrently */
+#define kMaxConfigReaders   64
+
 /* static data */
 
-static kConfigurationOptions  configurationOptions = {
-    0,
-    kLogDebug,
-    NULL,
-    NULL
+/* scratch space that popt parses into. Copied into an immutable snapshot once validated */
+static kConfigurationOptions  configurationOptions;
+
+/* what the scratch options are reset to before each parse */
+static const kConfigurationOptions  defaultOptions = {
+    .foreground       = 0,
+    .debugLevel       = kLogDebug,
+    .configFile       = NULL,
+    .logFile          = NULL,
+    .watchdog         = 5000,
+    .supervise        = 0,
+    .aggregate        = 0,
+    .flightRecorder   = NULL,
+    .flightDump       = NULL,
+    .logCompress      = NULL,
+    .logCompressLevel = -1,
+    .logFrameSize     = 1024,
+    .tick             = 2000,
+    .logShed          = 100,
+    .traceFilter      = NULL,
+    .traceCount       = 0
 };
 
+/* remembered from the first parse, so a reload sees the same command line */
+static int              gArgc;
+static const char **    gArgv;
+static char *           gConfigPath = NULL;   /* absolute path, as we chdir("/") when daemonizing */
+
+/*
+    The published snapshot is swapped with a single atomic exchange. Each reader
+    thread owns a slot, into which it copies the global epoch while it holds a
+    snapshot (zero when it holds none). After a swap, the writer advances the
+    epoch and waits until no slot holds an older epoch before freeing the old
+    snapshot.
+*/
+static _Atomic(kConfigurationOptions *) gConfigCurrent = NULL;
+static atomic_ulong     gConfigEpoch = 1;
+static atomic_ulong     gConfigReaders[kMaxConfigReaders];
+static atomic_int       gConfigReaderCount = 0;
+static __thread int     tConfigReader = -1;
+
+/* reload plumbing */
+static int              gConfigPipe[2] = { -1, -1 };
+static int              gConfigInotify = -1;
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 
@@ -32,6 +96,18 @@ static struct poptOption commandLineVocab[] =
     { "debug",      'd',  POPT_ARG_INT,    &configurationOptions.debugLevel, 0, "set the amount of logging (i.e. syslog priority)" },
     { "config",     'c',  POPT_ARG_STRING, &configurationOptions.configFile, 0, "read Configuration from <file>", "path to file" },
     { "logfile",    'l',  POPT_ARG_STRING, &configurationOptions.logFile,    0, "send logging to <file>", "path to file" },
+    { "watchdog",   'w',  POPT_ARG_INT,    &configurationOptions.watchdog,   0, "complain if the background loop stalls for <ms> (0 disables)", "milliseconds" },
+    { "supervise",  's',  POPT_ARG_VAL,    &configurationOptions.supervise,  1, "run the background loop in a worker, restarting it if it hangs or dies" },
+    { "aggregate",  'a',  POPT_ARG_VAL,    &configurationOptions.aggregate,  1, "have workers log through the master, via shared memory" },
+    { "flightrecorder", 'r', POPT_ARG_STRING, &configurationOptions.flightRecorder, 0, "record all logging, whatever the level, in a crash-proof ring in <file>", "path to file" },
+    { "flightdump", '\0', POPT_ARG_STRING, &configurationOptions.flightDump, 0, "decode the flight recorder in <file>, then exit", "path to file" },
+    { "logcompress", '\0', POPT_ARG_STRING, &configurationOptions.logCompress, 0, "compress the log file with <method>", "none|zlib|zstd" },
+    { "logcomplevel", '\0', POPT_ARG_INT, &configurationOptions.logCompressLevel, 0, "log file compression level (-1 for the default)", "level" },
+    { "logframesize", '\0', POPT_ARG_INT, &configurationOptions.logFrameSize, 0, "KiB of log per compressed frame", "KiB" },
+    { "tick",       't',  POPT_ARG_INT,    &configurationOptions.tick,       0, "go round the background loop every <ms> (0 for flat out)", "milliseconds" },
+    { "logshed",    '\0', POPT_ARG_INT,    &configurationOptions.logShed,    0, "shed lower priority logging when lines take over <us> to write (0 never sheds)", "microseconds" },
+    { "tracefilter", '\0', POPT_ARG_STRING, &configurationOptions.traceFilter, 0, "only trace the functions matching <filter>", "fn:name,scope:name,addr:from-to,all" },
+    { "tracecount", '\0', POPT_ARG_INT,    &configurationOptions.traceCount, 0, "count & time traced functions (0 no, 1 as well as logging them, 2 instead)", "0|1|2" },
     POPT_AUTOHELP
     POPT_TABLEEND
 };
@@ -45,6 +121,17 @@ static struct poptOption configFileVocab[] =
     { "debug",      '\0',  POPT_ARG_INT,    &configurationOptions.debugLevel, 0, "set the amount of logging (i.e. syslog priority)" },
     { "config",     '\0',  POPT_ARG_STRING, &configurationOptions.configFile, 0, "read Configuration from <file>", "path to file" },
     { "logfile",    '\0',  POPT_ARG_STRING, &configurationOptions.logFile,    0, "send logging to <file>", "path to file" },
+    { "watchdog",   '\0',  POPT_ARG_INT,    &configurationOptions.watchdog,   0, "complain if the background loop stalls for <ms> (0 disables)", "milliseconds" },
+    { "supervise",  '\0',  POPT_ARG_VAL,    &configurationOptions.supervise,  1, "run the background loop in a worker, restarting it if it hangs or dies" },
+    { "aggregate",  '\0',  POPT_ARG_VAL,    &configurationOptions.aggregate,  1, "have workers log through the master, via shared memory" },
+    { "flightrecorder", '\0', POPT_ARG_STRING, &configurationOptions.flightRecorder, 0, "record all logging, whatever the level, in a crash-proof ring in <file>", "path to file" },
+    { "logcompress", '\0', POPT_ARG_STRING, &configurationOptions.logCompress, 0, "compress the log file with <method>", "none|zlib|zstd" },
+    { "logcomplevel", '\0', POPT_ARG_INT, &configurationOptions.logCompressLevel, 0, "log file compression level (-1 for the default)", "level" },
+    { "logframesize", '\0', POPT_ARG_INT, &configurationOptions.logFrameSize, 0, "KiB of log per compressed frame", "KiB" },
+    { "tick",       '\0', POPT_ARG_INT,    &configurationOptions.tick,       0, "go round the background loop every <ms> (0 for flat out)", "milliseconds" },
+    { "logshed",    '\0', POPT_ARG_INT,    &configurationOptions.logShed,    0, "shed lower priority logging when lines take over <us> to write (0 never sheds)", "microseconds" },
+    { "tracefilter", '\0', POPT_ARG_STRING, &configurationOptions.traceFilter, 0, "only trace the functions matching <filter>", "fn:name,scope:name,addr:from-to,all" },
+    { "tracecount", '\0', POPT_ARG_INT,    &configurationOptions.traceCount, 0, "count & time traced functions (0 no, 1 as well as logging them, 2 instead)", "0|1|2" },
     POPT_TABLEEND
 };
 
@@ -119,7 +206,7 @@ int parseConfigFile(const char * configFile)
             /* add to argv */
             if (key != NULL)
             {
-                argv[argc] = malloc(strlen(key + 2 + 1));
+                argv[argc] = malloc(strlen(key) + 2 + 1);
                 if (argv[argc] != NULL)
                 {
                     strcpy(argv[argc],"--");
@@ -137,6 +224,7 @@ int parseConfigFile(const char * configFile)
             }
         }
         result = ferror(confFD);
+        fclose(confFD);
 
 #ifdef TACHYON
         /* debugging */
@@ -198,30 +286,469 @@ int parseCmdLineOptions( int argc, const char *argv[] )
     return 0;
 }
 
-kConfigurationOptions * parseConfiguration(int argc, const char *argv[])
+/* put the scratch options back to their defaults, ready for a fresh parse */
+static void resetOptions( void )
 {
+    /* popt leaves freeing the strings it allocated to us */
+    free( configurationOptions.configFile );
+    free( configurationOptions.logFile );
+    free( configurationOptions.flightRecorder );
+    free( configurationOptions.flightDump );
+    free( configurationOptions.logCompress );
+    free( configurationOptions.traceFilter );
+
+    configurationOptions = defaultOptions;
+}
+
+/* parse everything into the scratch options */
+static void readConfiguration( void )
+{
+    const char *configFile = NULL;
+
     /* first time through, we really only care if there's a config file specified */
-    parseCmdLineOptions( argc, argv );
+    parseCmdLineOptions( gArgc, gArgv );
 
     if (configurationOptions.configFile != NULL)
     { /* user explicitly provided a configuration file */
-        if (fileIsReadable(configurationOptions.configFile, 1))
+        if (fileIsReadable(gConfigPath != NULL ? gConfigPath : configurationOptions.configFile, 1))
         {
-            parseConfigFile(configurationOptions.configFile);
+            configFile = gConfigPath != NULL ? gConfigPath : configurationOptions.configFile;
         }
     }
     else
     { /* user didn't provide a config file, so look in the standard place for a config file */
-        if (fileIsReadable("/etc/toggled.conf", 0))
+        if (fileIsReadable(kDefaultConfigFile, 0))
+        {
+            configFile = kDefaultConfigFile;
+        }
+    }
+
+    if (configFile != NULL)
+    {
+        parseConfigFile(configFile);
+
+        /* command line options override config file, so parse them again */
+        parseCmdLineOptions( gArgc, gArgv );
+    }
+}
+
+/* returns -1 if the method isn't one we know */
+static int compressionMethod( const kConfigurationOptions *options )
+{
+    if ( options->logCompress == NULL || strcmp( options->logCompress, "none" ) == 0 )
+    {
+        return kCompressNone;
+    }
+    if ( strcmp( options->logCompress, "zlib" ) == 0 || strcmp( options->logCompress, "gzip" ) == 0 )
+    {
+        return kCompressZlib;
+    }
+    if ( strcmp( options->logCompress, "zstd" ) == 0 )
+    {
+        return kCompressZstd;
+    }
+    return -1;
+}
+
+static int validateConfiguration( const kConfigurationOptions *options )
+{
+    if ( options->debugLevel < kLogEmergency || options->debugLevel > kLogDebug )
+    {
+        logError( "debug level %d is out of range (%d to %d)", options->debugLevel, kLogEmergency, kLogDebug );
+        return EINVAL;
+    }
+
+    if ( options->logFile != NULL && access( options->logFile, W_OK ) != 0 && errno != ENOENT )
+    {
+        logError( "Cannot write to log file \"%s\" (%s [%d])", options->logFile, strerror(errno), errno );
+        return errno;
+    }
+
+    if ( options->watchdog < 0 )
+    {
+        logError( "watchdog deadline %d ms is negative", options->watchdog );
+        return EINVAL;
+    }
+
+    switch ( compressionMethod( options ) )
+    {
+    case kCompressZlib:
+        if ( options->logCompressLevel < -1 || options->logCompressLevel > 9 )
+        {
+            logError( "zlib compression level %d is out of range (-1 to 9)", options->logCompressLevel );
+            return EINVAL;
+        }
+        break;
+
+    case kCompressZstd:
+#ifdef HAVE_ZSTD
+        if ( options->logCompressLevel < -1 || options->logCompressLevel > 22 )
         {
-            parseConfigFile("/etc/toggled.conf");
+            logError( "zstd compression level %d is out of range (-1 to 22)", options->logCompressLevel );
+            return EINVAL;
         }
+        break;
+#else
+        logError( "zstd compression isn't available in this build" );
+        return ENOTSUP;
+#endif
+
+    case kCompressNone:
+        break;
+
+    default:
+        logError( "unknown log compression \"%s\"", options->logCompress );
+        return EINVAL;
+    }
+
+    if ( options->logFrameSize < 4 || options->logFrameSize > 65536 )
+    {
+        logError( "log frame size %d KiB is out of range (4 to 65536)", options->logFrameSize );
+        return EINVAL;
     }
 
-    /* command line options override config file, so parse them again */
-    parseCmdLineOptions( argc, argv );
+    if ( options->tick < 0 )
+    {
+        logError( "background loop tick %d ms is negative", options->tick );
+        return EINVAL;
+    }
 
-    return &configurationOptions;
+    if ( options->logShed < 0 )
+    {
+        logError( "log shedding latency %d us is negative", options->logShed );
+        return EINVAL;
+    }
+
+    if ( options->traceCount < kTraceCountOff || options->traceCount > kTraceCountOnly )
+    {
+        logError( "trace count %d is out of range (%d to %d)", options->traceCount, kTraceCountOff, kTraceCountOnly );
+        return EINVAL;
+    }
+
+    if ( functionTraceFilterValid( options->traceFilter ) != 0 )
+    {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+static char * copyString( const char *str )
+{
+    return (str != NULL) ? strdup( str ) : NULL;
+}
+
+static void freeSnapshot( kConfigurationOptions *snapshot )
+{
+    if ( snapshot != NULL )
+    {
+        free( snapshot->configFile );
+        free( snapshot->logFile );
+        free( snapshot->flightRecorder );
+        free( snapshot->flightDump );
+        free( snapshot->logCompress );
+        free( snapshot->traceFilter );
+        free( snapshot );
+    }
+}
+
+static kConfigurationOptions * snapshotConfiguration( const kConfigurationOptions *options )
+{
+    kConfigurationOptions *snapshot;
+
+    snapshot = malloc( sizeof(kConfigurationOptions) );
+    if ( snapshot != NULL )
+    {
+        *snapshot = *options;
+        snapshot->configFile = copyString( options->configFile );
+        snapshot->logFile    = copyString( options->logFile );
+        snapshot->flightRecorder = copyString( options->flightRecorder );
+        snapshot->flightDump     = copyString( options->flightDump );
+        snapshot->logCompress    = copyString( options->logCompress );
+        snapshot->traceFilter    = copyString( options->traceFilter );
+    }
+    return snapshot;
+}
+
+/* claim this thread's reader slot, the first time it reads the configuration */
+static atomic_ulong * configReaderSlot( void )
+{
+    if ( tConfigReader < 0 )
+    {
+        tConfigReader = atomic_fetch_add( &gConfigReaderCount, 1 );
+        if ( tConfigReader >= kMaxConfigReaders )
+        {
+            logCritical( "### more than %d threads reading the configuration - exiting", kMaxConfigReaders );
+            exit( ENOMEM ); // fatal
+        }
+    }
+    return &gConfigReaders[tConfigReader];
+}
+
+const kConfigurationOptions * configAcquire( void )
+{
+    atomic_store( configReaderSlot(), atomic_load( &gConfigEpoch ) );
+
+    return atomic_load( &gConfigCurrent );
+}
+
+void configRelease( void )
+{
+    atomic_store( configReaderSlot(), 0 );
+}
+
+/* swap in a new snapshot, and reclaim the old one once no reader can still see it */
+static void publishConfiguration( kConfigurationOptions *snapshot )
+{
+    kConfigurationOptions  *previous;
+    unsigned long           epoch, seen;
+    int                     i, count;
+
+    previous = atomic_exchange( &gConfigCurrent, snapshot );
+    epoch    = atomic_fetch_add( &gConfigEpoch, 1 ) + 1;
+
+    count = atomic_load( &gConfigReaderCount );
+    if ( count > kMaxConfigReaders )
+    {
+        count = kMaxConfigReaders;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( i == tConfigReader )
+        {
+            continue; // this thread isn't holding a snapshot while it publishes
+        }
+        for ( seen = atomic_load( &gConfigReaders[i] ); seen != 0 && seen < epoch; seen = atomic_load( &gConfigReaders[i] ) )
+        {
+            sched_yield();
+        }
+    }
+
+    freeSnapshot( previous );
+}
+
+void configureLogging( const kConfigurationOptions *options )
+{
+    eLogDestination logTo;
+
+    if (logRingAttached())
+    {
+        logTo = kLogToRing; /* the master does the actual writing */
+    }
+    else if (options->logFile != NULL)
+    {
+        logTo = kLogToFile;
+    }
+    else if (options->foreground)
+    {
+        logTo = kLogToStderr;
+    }
+    else
+    {
+        logTo = kLogToSyslog;
+    }
+
+    logCompression( compressionMethod( options ), options->logCompressLevel, options->logFrameSize * 1024 );
+    logShedding( options->logShed );
+    functionTraceFilter( options->traceFilter );
+    functionTraceCounting( options->traceCount );
+    startLogging( options->debugLevel, logTo, options->logFile );
+}
+
+const kConfigurationOptions * parseConfiguration(int argc, const char *argv[])
+{
+    kConfigurationOptions *snapshot;
+
+    gArgc = argc;
+    gArgv = argv;
+
+    resetOptions();
+    readConfiguration();
+
+    /* pin down the config file's location, so it can still be found after we chdir("/") */
+    gConfigPath = realpath( configurationOptions.configFile != NULL ? configurationOptions.configFile : kDefaultConfigFile, NULL );
+
+    /* unlike a reload, there's no good configuration to fall back on */
+    if ( validateConfiguration( &configurationOptions ) != 0 )
+    {
+        logCritical( "### invalid configuration - exiting" );
+        exit( EINVAL ); // fatal
+    }
+
+    snapshot = snapshotConfiguration( &configurationOptions );
+    if ( snapshot == NULL )
+    {
+        logCritical( "### Failed to allocate memory for the configuration - exiting" );
+        exit( ENOMEM ); // fatal
+    }
+    publishConfiguration( snapshot );
+
+    return snapshot;
+}
+
+int reloadConfiguration( void )
+{
+    kConfigurationOptions *snapshot;
+    int                    result;
+
+    if ( tConfigReader >= 0 && atomic_load( &gConfigReaders[tConfigReader] ) != 0 )
+    {
+        logError( "configuration reloaded while this thread holds a snapshot" );
+        return EBUSY;
+    }
+
+    resetOptions();
+    readConfiguration();
+
+    result = validateConfiguration( &configurationOptions );
+    if ( result != 0 )
+    {
+        logError( "rejected the new configuration, keeping the current one" );
+        return result;
+    }
+
+    snapshot = snapshotConfiguration( &configurationOptions );
+    if ( snapshot == NULL )
+    {
+        logError( "Unable to allocate a configuration snapshot (%s [%d])", strerror(ENOMEM), ENOMEM );
+        return ENOMEM;
+    }
+    publishConfiguration( snapshot );
+
+    configureLogging( snapshot );
+
+    logInfo( "configuration reloaded" );
+
+    return 0;
+}
+
+/* SIGHUP handler. Only async-signal-safe work in here */
+static void requestReload( int UNUSED(signal) )
+{
+    int saved = errno;
+
+    if ( write( gConfigPipe[1], "", 1 ) < 0 )
+    {
+        /* the pipe is full, so a reload is already pending */
+    }
+    errno = saved;
+}
+
+int configWatch( void )
+{
+    struct sigaction    action;
+    struct epoll_event  event;
+    char                dirScratch[PATH_MAX];
+    int                 watchFd;
+
+    watchFd = epoll_create1( EPOLL_CLOEXEC );
+    if ( watchFd < 0 || pipe2( gConfigPipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+    {
+        logError( "unable to watch for configuration changes (%s [%d])", strerror(errno), errno );
+        return -1;
+    }
+
+    event.events  = EPOLLIN;
+    event.data.fd = gConfigPipe[0];
+    epoll_ctl( watchFd, EPOLL_CTL_ADD, gConfigPipe[0], &event );
+
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = &requestReload;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset( &action.sa_mask );
+    if ( sigaction( SIGHUP, &action, NULL ) < 0 )
+    {
+        logError( "unable to trap SIGHUP (%s [%d])", strerror(errno), errno );
+    }
+
+    if ( gConfigPath != NULL )
+    {
+        /* watch the directory, as editors often replace the file rather than rewrite it */
+        gConfigInotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+        strncpy( dirScratch, gConfigPath, sizeof(dirScratch) - 1 );
+        dirScratch[sizeof(dirScratch) - 1] = '\0';
+
+        if ( gConfigInotify < 0
+          || inotify_add_watch( gConfigInotify, dirname( dirScratch ), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 )
+        {
+            logError( "unable to watch \"%s\" (%s [%d])", gConfigPath, strerror(errno), errno );
+        }
+        else
+        {
+            event.events  = EPOLLIN;
+            event.data.fd = gConfigInotify;
+            epoll_ctl( watchFd, EPOLL_CTL_ADD, gConfigInotify, &event );
+        }
+    }
+
+    return watchFd;
+}
+
+int configChanged( int watchFd )
+{
+    struct epoll_event          events[2];
+    const struct inotify_event *notice;
+    char                        buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char                       *base;
+    ssize_t                     len, offset;
+    int                         i, count, changed;
+
+    changed = 0;
+    base    = strrchr( gConfigPath != NULL ? gConfigPath : kDefaultConfigFile, '/' ) + 1;
+
+    count = epoll_wait( watchFd, events, 2, 0 );
+    for ( i = 0; i < count; ++i )
+    {
+        if ( events[i].data.fd == gConfigPipe[0] )
+        {
+            while ( read( gConfigPipe[0], buffer, sizeof(buffer) ) > 0 )
+            { /* drain it */ }
+            changed |= kConfigSignalled;
+        }
+        else if ( events[i].data.fd == gConfigInotify )
+        {
+            while ( (len = read( gConfigInotify, buffer, sizeof(buffer) )) > 0 )
+            {
+                for ( offset = 0; offset < len; offset += sizeof(struct inotify_event) + notice->len )
+                {
+                    notice = (const struct inotify_event *)&buffer[offset];
+                    if ( notice->len > 0 && strcmp( notice->name, base ) == 0 )
+                    {
+                        changed |= kConfigEdited;
+                    }
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+void configUnwatch( int watchFd )
+{
+    struct sigaction    action;
+
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = SIG_IGN;
+    sigemptyset( &action.sa_mask );
+    sigaction( SIGHUP, &action, NULL );
+
+    if ( gConfigInotify >= 0 )
+    {
+        close( gConfigInotify );
+        gConfigInotify = -1;
+    }
+    if ( gConfigPipe[0] >= 0 )
+    {
+        close( gConfigPipe[0] );
+        close( gConfigPipe[1] );
+        gConfigPipe[0] = gConfigPipe[1] = -1;
+    }
+    if ( watchFd >= 0 )
+    {
+        close( watchFd );
+    }
 }
 
 #include "logging-epilogue.h"    /* our logging support */
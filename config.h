@@ -7,9 +7,49 @@ typedef struct {
     int     debugLevel;     /* controls the amount of logging (syslog priority) */
     char *  configFile;     /* config file path, or NULL for default search */
     char *  logFile;        /* file destination for logs, or NULL if the user didn't supply one */
+    int     watchdog;       /* ms the background loop may stall before we complain, 0 to disable */
+    int     supervise;      /* if non-zero, run the background loop in a worker, restarting it if it hangs */
+    int     aggregate;      /* if non-zero, workers log via shared memory, and the master does the writing */
+    char *  flightRecorder; /* file for the flight recorder's ring, or NULL if it isn't wanted */
+    char *  flightDump;     /* if set, decode this flight recorder file and exit */
+    char *  logCompress;    /* compress the log file with "zlib" or "zstd", or NULL for "none" */
+    int     logCompressLevel; /* compression level, -1 for the compressor's default */
+    int     logFrameSize;   /* KiB of log lines per independently decodable compressed frame */
+    int     tick;           /* ms between passes of the background loop, 0 to go round as fast as possible */
+    int     logShed;        /* us per log line written at which lower priorities are shed, 0 never to */
+    char *  traceFilter;    /* which functions to trace (see functrace.h), or NULL for all of them */
+    int     traceCount;     /* count & time traced functions: 0 no, 1 as well as logging them, 2 instead */
 
 } kConfigurationOptions;
 
-kConfigurationOptions * parseConfiguration(int argc, const char *argv[] );
+/* parse the command line & config file, and publish the first configuration snapshot */
+const kConfigurationOptions * parseConfiguration(int argc, const char *argv[] );
+
+/* re-parse the configuration and, if it's valid, atomically publish it. Returns 0 on success */
+int     reloadConfiguration( void );
+
+/*
+    Readers bracket their use of the current snapshot with configAcquire/configRelease.
+    Neither takes a lock. Don't nest them, and don't hold a snapshot across a call
+    to reloadConfiguration on the same thread.
+*/
+const kConfigurationOptions * configAcquire( void );
+void    configRelease( void );
+
+/* (re)start logging as described by a configuration snapshot */
+void    configureLogging( const kConfigurationOptions *options );
+
+/* watch the config file & SIGHUP for reload requests. Returns an fd to poll for POLLIN, or -1 */
+int     configWatch( void );
+
+/* what configChanged saw. Either means a reload is due */
+#define kConfigEdited       1   /* the config file was written or replaced */
+#define kConfigSignalled    2   /* we were sent SIGHUP */
+
+/* drain the fd returned by configWatch. Returns the kConfig bits for what it saw, 0 if nothing */
+int     configChanged( int watchFd );
+
+/* stop watching, and ignore SIGHUP until configWatch is called again. For a freshly forked child */
+void    configUnwatch( int watchFd );
 
 #endif
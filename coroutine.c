@@ -0,0 +1,834 @@
+/*
+    Stackful coroutines for the background loop.
+
+    Stacks are mmap()ed with a PROT_NONE guard page below them, so an overflow
+    faults instead of quietly corrupting a neighbour. Only the pages a
+    coroutine actually touches take up memory, so thousands of small ones fit
+    in a few MB. Finished coroutines' stacks go back to a pool, after handing
+    all but their top page back to the kernel.
+
+    Switching is done by hand on x86-64 - it only has to save the callee-saved
+    registers and the stack pointer - and with swapcontext() elsewhere.
+
+    The scheduler only ever switches to a coroutine and back again. Waiting
+    coroutines are woken by epoll (fds), a timing wheel (timers and timeouts),
+    or another coroutine (channels).
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#ifndef __x86_64__
+# include <ucontext.h>
+#endif
+
+#include "coroutine.h"
+#include "timerwheel.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kDefaultStackSize   (256 * 1024)    /* the reloader runs a whole reload - config parsing, reopening the log, setting up a compressor - on its stack */
+#define kMaxStackSize       (8 * 1024 * 1024)
+#define kMaxPooledStacks    256     /* beyond this, finished coroutines' stacks are unmapped */
+#define kMaxEvents          64
+#define kTimerResolution    1       /* ms per tick of the scheduler's timing wheel */
+
+typedef enum { kCoroutineReady, kCoroutineRunning, kCoroutineWaiting, kCoroutineDead } eCoroutineState;
+
+typedef struct {
+    tCoroutine     *head;
+    tCoroutine     *tail;
+} tQueue;
+
+struct sCoroutine {
+    void               *sp;             /* saved stack pointer, while switched out */
+#ifndef __x86_64__
+    ucontext_t          ucontext;
+#endif
+    const char         *name;
+    fpCoroutine         entry;
+    void               *context;
+    eCoroutineState     state;
+    unsigned char      *mapping;        /* the stack, with its guard page at the bottom */
+
+    tCoroutine         *next;           /* in the ready queue, or a channel's wait queue */
+    tCoroutine         *prev;
+    tQueue             *queue;          /* the wait queue it's in, if any */
+    tCoroutine         *nextAlive;
+    tCoroutine         *prevAlive;
+
+    int                 fd;             /* being waited for, or -1 */
+    uint32_t            events;         /* the events that woke it */
+    tTimer             *timer;          /* its timeout, if it's waiting with one */
+    int                 result;         /* why it was woken */
+    void               *item;           /* a channel item, on its way in or out */
+
+    tCoroutineStats     stats;
+};
+
+struct sChannel {
+    void          **ring;
+    unsigned int    capacity;
+    unsigned int    head;
+    unsigned int    count;
+    int             closed;
+    tQueue          senders;
+    tQueue          receivers;
+};
+
+static tCoroutine       gScheduler;             /* just somewhere to save the scheduler's context */
+static tCoroutine *     gCurrent = NULL;
+static tQueue           gReady;
+static tCoroutine *     gAlive = NULL;
+static int              gEpoll = -1;
+
+static size_t           gPageSize;
+static size_t           gStackSize;
+static unsigned char *  gStackPool = NULL;      /* free stacks, linked through their top word */
+
+static tTimerWheel *    gTimers = NULL;
+
+static tCoroutineTotals gTotals;
+
+
+#ifdef __x86_64__
+/*
+    Save the callee-saved registers, MXCSR & the x87 control word on the current
+    stack, store the stack pointer in *save, and pick up where restore left off.
+*/
+void coroutineSwitch( void **save, void *restore ) __attribute__((visibility("hidden")));
+
+__asm__ (
+    "    .text\n"
+    "    .p2align 4\n"
+    "    .globl  coroutineSwitch\n"
+    "    .hidden coroutineSwitch\n"
+    "    .type   coroutineSwitch, @function\n"
+    "coroutineSwitch:\n"
+    "    pushq   %rbp\n"
+    "    pushq   %rbx\n"
+    "    pushq   %r12\n"
+    "    pushq   %r13\n"
+    "    pushq   %r14\n"
+    "    pushq   %r15\n"
+    "    subq    $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw  4(%rsp)\n"
+    "    movq    %rsp, (%rdi)\n"
+    "    movq    %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw   4(%rsp)\n"
+    "    addq    $8, %rsp\n"
+    "    popq    %r15\n"
+    "    popq    %r14\n"
+    "    popq    %r13\n"
+    "    popq    %r12\n"
+    "    popq    %rbx\n"
+    "    popq    %rbp\n"
+    "    ret\n"
+    "    .size   coroutineSwitch, .-coroutineSwitch\n"
+);
+#endif
+
+
+/********** DO NOT INSTRUMENT THE SCHEDULER! **********/
+/*
+    Anything that can switch stacks would leave the function tracing's call
+    depth wrong on every pass, and the rest is called too often to be worth
+    tracing anyway. The coroutines themselves are traced as usual.
+*/
+
+static unsigned long long nowNs( void )             __attribute__((no_instrument_function));
+static void queuePush( tQueue *queue, tCoroutine *coroutine )
+                                                    __attribute__((no_instrument_function));
+static void queueRemove( tQueue *queue, tCoroutine *coroutine )
+                                                    __attribute__((no_instrument_function));
+static tCoroutine * queuePop( tQueue *queue )       __attribute__((no_instrument_function));
+static void contextSwitch( tCoroutine *from, tCoroutine *to )
+                                                    __attribute__((no_instrument_function));
+static void coroutineStart( void )                  __attribute__((no_instrument_function));
+static void resume( tCoroutine *coroutine )         __attribute__((no_instrument_function));
+static int  suspend( int timeout )                  __attribute__((no_instrument_function));
+static void wake( tCoroutine *coroutine, int result )
+                                                    __attribute__((no_instrument_function));
+static void timedOut( void *context )               __attribute__((no_instrument_function));
+unsigned int coroutineRun( int timeout )            __attribute__((no_instrument_function));
+void coroutineYield( void )                         __attribute__((no_instrument_function));
+int  coroutineAwaitFd( int fd, uint32_t events, int timeout )
+                                                    __attribute__((no_instrument_function));
+void coroutineSleep( unsigned int ms )              __attribute__((no_instrument_function));
+int  channelSend( tChannel *channel, void *item )   __attribute__((no_instrument_function));
+int  channelReceive( tChannel *channel, void **item, int timeout )
+                                                    __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE SCHEDULER! **********/
+
+static unsigned long long nowNs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/********** queues **********/
+
+static void queuePush( tQueue *queue, tCoroutine *coroutine )
+{
+    coroutine->next = NULL;
+    coroutine->prev = queue->tail;
+    if ( queue->tail != NULL )
+    {
+        queue->tail->next = coroutine;
+    }
+    else
+    {
+        queue->head = coroutine;
+    }
+    queue->tail = coroutine;
+}
+
+static void queueRemove( tQueue *queue, tCoroutine *coroutine )
+{
+    if ( coroutine->prev != NULL )  coroutine->prev->next = coroutine->next;
+    else                            queue->head = coroutine->next;
+    if ( coroutine->next != NULL )  coroutine->next->prev = coroutine->prev;
+    else                            queue->tail = coroutine->prev;
+
+    coroutine->next = coroutine->prev = NULL;
+}
+
+static tCoroutine * queuePop( tQueue *queue )
+{
+    tCoroutine  *coroutine;
+
+    coroutine = queue->head;
+    if ( coroutine != NULL )
+    {
+        queueRemove( queue, coroutine );
+    }
+    return coroutine;
+}
+
+/********** stacks **********/
+
+static unsigned char * stackAllocate( void )
+{
+    unsigned char  *mapping;
+
+    if ( gStackPool != NULL )
+    {
+        mapping    = gStackPool;
+        gStackPool = *(unsigned char **)(mapping + gPageSize + gStackSize - sizeof(void *));
+        --gTotals.stacksPooled;
+        return mapping;
+    }
+
+    mapping = mmap( NULL, gPageSize + gStackSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0 );
+    if ( mapping == MAP_FAILED )
+    {
+        logError( "unable to map a coroutine stack (%s [%d])", strerror(errno), errno );
+        return NULL;
+    }
+    if ( mprotect( mapping, gPageSize, PROT_NONE ) != 0 )
+    {
+        logError( "unable to protect a coroutine stack's guard page (%s [%d])", strerror(errno), errno );
+        munmap( mapping, gPageSize + gStackSize );
+        return NULL;
+    }
+    gTotals.stackMapped += gPageSize + gStackSize;
+    return mapping;
+}
+
+static void stackFree( unsigned char *mapping )
+{
+    if ( gTotals.stacksPooled >= kMaxPooledStacks )
+    {
+        munmap( mapping, gPageSize + gStackSize );
+        gTotals.stackMapped -= gPageSize + gStackSize;
+        return;
+    }
+
+    /* the next coroutine starts with a clean slate - and only the top page resident */
+    madvise( mapping + gPageSize, gStackSize - gPageSize, MADV_DONTNEED );
+
+    *(unsigned char **)(mapping + gPageSize + gStackSize - sizeof(void *)) = gStackPool;
+    gStackPool = mapping;
+    ++gTotals.stacksPooled;
+}
+
+/* bytes of the stack that have been touched, to the page. They're used from the top down */
+static size_t stackResident( const unsigned char *mapping )
+{
+    unsigned char   resident[kMaxStackSize / 4096];
+    size_t          pages, i, count;
+
+    pages = gStackSize / gPageSize;
+    if ( pages > sizeof(resident) || mincore( (void *)(mapping + gPageSize), gStackSize, resident ) != 0 )
+    {
+        return 0;
+    }
+    for ( i = 0, count = 0; i < pages; ++i )
+    {
+        count += resident[i] & 1;
+    }
+    return count * gPageSize;
+}
+
+/********** switching **********/
+
+static void contextSwitch( tCoroutine *from, tCoroutine *to )
+{
+#ifdef __x86_64__
+    coroutineSwitch( &from->sp, to->sp );
+#else
+    swapcontext( &from->ucontext, &to->ucontext );
+#endif
+}
+
+/* where every coroutine starts */
+static void coroutineStart( void )
+{
+    tCoroutine  *self = gCurrent;
+
+    self->entry( self->context );
+
+    self->state = kCoroutineDead;
+    contextSwitch( self, &gScheduler ); /* never comes back */
+    abort();
+}
+
+static void coroutineDestroy( tCoroutine *coroutine )
+{
+    if ( coroutine->prevAlive != NULL ) coroutine->prevAlive->nextAlive = coroutine->nextAlive;
+    else                                gAlive = coroutine->nextAlive;
+    if ( coroutine->nextAlive != NULL ) coroutine->nextAlive->prevAlive = coroutine->prevAlive;
+
+    --gTotals.alive;
+    stackFree( coroutine->mapping );
+    free( coroutine );
+}
+
+static void resume( tCoroutine *coroutine )
+{
+    unsigned long long  started;
+
+    gCurrent         = coroutine;
+    coroutine->state = kCoroutineRunning;
+    ++coroutine->stats.resumes;
+    ++gTotals.switches;
+
+    started = nowNs();
+    contextSwitch( &gScheduler, coroutine );
+    coroutine->stats.runNs += nowNs() - started;
+    gCurrent = NULL;
+
+    if ( coroutine->state == kCoroutineDead )
+    {
+        coroutineDestroy( coroutine );
+    }
+}
+
+/* park the running coroutine until something wakes it, or for timeout ms (-1 for ever). Returns why it woke */
+static int suspend( int timeout )
+{
+    tCoroutine  *self = gCurrent;
+
+    self->state  = kCoroutineWaiting;
+    self->result = 0;
+    ++self->stats.waits;
+
+    if ( timeout >= 0 )
+    {
+        self->timer = timerStart( gTimers, timeout, timedOut, self );
+        if ( self->timer == NULL )
+        {
+            self->state = kCoroutineRunning;
+            return ENOMEM;
+        }
+    }
+
+    contextSwitch( self, &gScheduler );
+    return self->result;
+}
+
+/* make a waiting coroutine ready to run again, undoing whatever it was waiting on */
+static void wake( tCoroutine *coroutine, int result )
+{
+    if ( coroutine->state != kCoroutineWaiting )
+    {
+        return;
+    }
+
+    if ( coroutine->timer != NULL )
+    {
+        timerCancel( gTimers, coroutine->timer );
+        coroutine->timer = NULL;
+    }
+    if ( coroutine->queue != NULL )
+    {
+        queueRemove( coroutine->queue, coroutine );
+        coroutine->queue = NULL;
+    }
+    if ( coroutine->fd >= 0 )
+    {
+        epoll_ctl( gEpoll, EPOLL_CTL_DEL, coroutine->fd, NULL );
+        coroutine->fd = -1;
+    }
+
+    coroutine->result = result;
+    coroutine->state  = kCoroutineReady;
+    queuePush( &gReady, coroutine );
+}
+
+/* a waiting coroutine's timeout has come round */
+static void timedOut( void *context )
+{
+    tCoroutine  *coroutine = context;
+
+    coroutine->timer = NULL; /* it's already gone */
+    if ( coroutine->fd >= 0 || coroutine->queue != NULL )
+    {
+        ++coroutine->stats.timeouts; /* rather than a plain sleep */
+    }
+    wake( coroutine, ETIMEDOUT );
+}
+
+/********** the public face **********/
+
+int coroutineInit( size_t stackSize )
+{
+    stack_t     signalStack;
+
+    gPageSize  = sysconf( _SC_PAGESIZE );
+    gStackSize = (stackSize != 0) ? stackSize : kDefaultStackSize;
+    gStackSize = (gStackSize + gPageSize - 1) & ~(gPageSize - 1);
+    if ( gStackSize < 2 * gPageSize || gStackSize > kMaxStackSize )
+    {
+        logError( "coroutine stack size %zu is out of range (%zu to %d)", gStackSize, 2 * gPageSize, kMaxStackSize );
+        return EINVAL;
+    }
+
+    gTimers = timerWheelCreate( kTimerResolution );
+    if ( gTimers == NULL )
+    {
+        logError( "unable to create the coroutine scheduler's timers (%s [%d])", strerror(errno), errno );
+        return errno;
+    }
+
+    gEpoll = epoll_create1( EPOLL_CLOEXEC );
+    if ( gEpoll < 0 )
+    {
+        logError( "unable to create the coroutine scheduler's epoll fd (%s [%d])", strerror(errno), errno );
+        return errno;
+    }
+
+    /* a coroutine that runs into its guard page can't take the SIGSEGV on its own stack */
+    signalStack.ss_size  = 4 * SIGSTKSZ;
+    signalStack.ss_flags = 0;
+    signalStack.ss_sp    = mmap( NULL, signalStack.ss_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( signalStack.ss_sp == MAP_FAILED || sigaltstack( &signalStack, NULL ) != 0 )
+    {
+        logWarning( "unable to set up an alternate signal stack (%s [%d])", strerror(errno), errno );
+    }
+
+    return 0;
+}
+
+tCoroutine * coroutineSpawn( const char *name, fpCoroutine entry, void *context )
+{
+    tCoroutine     *coroutine;
+    void          **top;
+
+    coroutine = calloc( 1, sizeof(tCoroutine) );
+    if ( coroutine == NULL )
+    {
+        return NULL;
+    }
+    coroutine->mapping = stackAllocate();
+    if ( coroutine->mapping == NULL )
+    {
+        free( coroutine );
+        return NULL;
+    }
+
+    coroutine->name            = name;
+    coroutine->entry           = entry;
+    coroutine->context         = context;
+    coroutine->fd              = -1;
+    coroutine->stats.stackSize = gStackSize;
+
+#ifdef __x86_64__
+    /*
+        Lay out the stack as coroutineSwitch would have left it, so its 'ret'
+        lands in coroutineStart with the stack aligned as if it had been called.
+        A zero return address above that ends any backtrace.
+    */
+    top = (void **)(((uintptr_t)(coroutine->mapping + gPageSize + gStackSize) - sizeof(void *)) & ~(uintptr_t)15);
+    *--top = NULL;                      /* coroutineStart's 'return address' */
+    *--top = (void *)coroutineStart;    /* where coroutineSwitch returns to */
+    top   -= 6;                         /* rbp, rbx, r12 - r15 */
+    memset( top, 0, 6 * sizeof(void *) );
+    --top;
+    ((uint32_t *)top)[0] = 0x1f80;      /* MXCSR: the default rounding & exception masks */
+    ((uint32_t *)top)[1] = 0x037f;      /* x87 control word: likewise */
+    coroutine->sp = top;
+#else
+    (void)top;
+    getcontext( &coroutine->ucontext );
+    coroutine->ucontext.uc_stack.ss_sp   = coroutine->mapping + gPageSize;
+    coroutine->ucontext.uc_stack.ss_size = gStackSize - sizeof(void *); /* leave the pool's link alone */
+    coroutine->ucontext.uc_link          = NULL;
+    makecontext( &coroutine->ucontext, coroutineStart, 0 );
+#endif
+
+    coroutine->nextAlive = gAlive;
+    if ( gAlive != NULL )
+    {
+        gAlive->prevAlive = coroutine;
+    }
+    gAlive = coroutine;
+    ++gTotals.alive;
+    ++gTotals.spawned;
+
+    coroutine->state = kCoroutineReady;
+    queuePush( &gReady, coroutine );
+
+    return coroutine;
+}
+
+unsigned int coroutineRun( int timeout )
+{
+    struct epoll_event  events[kMaxEvents];
+    tQueue              ready;
+    tCoroutine         *coroutine;
+    int                 count, i, wait;
+
+    /* just the ones that are ready now. Any they make ready wait until we've checked for events */
+    ready  = gReady;
+    gReady.head = gReady.tail = NULL;
+    while ( (coroutine = queuePop( &ready )) != NULL )
+    {
+        resume( coroutine );
+    }
+
+    if ( gTotals.alive == 0 )
+    {
+        return 0; /* nothing left to wait for */
+    }
+
+    wait = timerWheelTimeout( gTimers );
+    if ( gReady.head != NULL )
+    {
+        timeout = 0;
+    }
+    else if ( wait >= 0 && (timeout < 0 || wait < timeout) )
+    {
+        timeout = wait;
+    }
+
+    count = epoll_wait( gEpoll, events, kMaxEvents, timeout );
+    for ( i = 0; i < count; ++i )
+    {
+        coroutine = events[i].data.ptr;
+        coroutine->events = events[i].events;
+        wake( coroutine, 0 );
+    }
+
+    timerWheelAdvance( gTimers );
+
+    return gTotals.alive;
+}
+
+tTimerWheel * coroutineTimers( void )
+{
+    return gTimers;
+}
+
+tCoroutine * coroutineSelf( void )
+{
+    return gCurrent;
+}
+
+void coroutineYield( void )
+{
+    tCoroutine  *self = gCurrent;
+
+    if ( self != NULL )
+    {
+        self->state = kCoroutineReady;
+        queuePush( &gReady, self );
+        contextSwitch( self, &gScheduler );
+    }
+}
+
+int coroutineAwaitFd( int fd, uint32_t events, int timeout )
+{
+    tCoroutine         *self = gCurrent;
+    struct epoll_event  event;
+    int                 result;
+
+    if ( self == NULL )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    event.events   = events | EPOLLONESHOT;
+    event.data.ptr = self;
+    if ( epoll_ctl( gEpoll, EPOLL_CTL_ADD, fd, &event ) != 0 )
+    {
+        if ( errno == EPERM )
+        {
+            return events; /* a regular file - always ready */
+        }
+        return -1;
+    }
+    self->fd = fd;
+
+    result = suspend( timeout );
+    if ( result != 0 )
+    {
+        if ( self->fd >= 0 )
+        {
+            /* couldn't wait after all */
+            epoll_ctl( gEpoll, EPOLL_CTL_DEL, fd, NULL );
+            self->fd = -1;
+        }
+        if ( result == ETIMEDOUT )
+        {
+            return 0;
+        }
+        errno = result;
+        return -1;
+    }
+    return self->events;
+}
+
+void coroutineSleep( unsigned int ms )
+{
+    if ( ms == 0 )
+    {
+        coroutineYield();
+    }
+    else if ( gCurrent != NULL )
+    {
+        suspend( ms );
+    }
+    else
+    {
+        usleep( ms * 1000 );
+    }
+}
+
+tChannel * channelCreate( unsigned int capacity )
+{
+    tChannel    *channel;
+
+    channel = calloc( 1, sizeof(tChannel) );
+    if ( channel != NULL && capacity > 0 )
+    {
+        channel->ring = calloc( capacity, sizeof(void *) );
+        if ( channel->ring == NULL )
+        {
+            free( channel );
+            return NULL;
+        }
+    }
+    if ( channel != NULL )
+    {
+        channel->capacity = capacity;
+    }
+    return channel;
+}
+
+void channelClose( tChannel *channel )
+{
+    tCoroutine  *waiting;
+
+    channel->closed = 1;
+    while ( (waiting = channel->receivers.head) != NULL )
+    {
+        wake( waiting, EPIPE );
+    }
+    while ( (waiting = channel->senders.head) != NULL )
+    {
+        wake( waiting, EPIPE );
+    }
+}
+
+void channelDestroy( tChannel *channel )
+{
+    if ( channel != NULL )
+    {
+        channelClose( channel );
+        free( channel->ring );
+        free( channel );
+    }
+}
+
+int channelSend( tChannel *channel, void *item )
+{
+    tCoroutine  *self = gCurrent;
+    tCoroutine  *receiver;
+
+    if ( channel->closed )
+    {
+        return EPIPE;
+    }
+
+    /* straight to someone who's waiting for it */
+    receiver = channel->receivers.head;
+    if ( receiver != NULL )
+    {
+        receiver->item = item;
+        wake( receiver, 0 );
+        return 0;
+    }
+
+    if ( channel->count < channel->capacity )
+    {
+        channel->ring[(channel->head + channel->count++) % channel->capacity] = item;
+        return 0;
+    }
+
+    if ( self == NULL )
+    {
+        return EAGAIN;
+    }
+
+    /* wait for a receiver to take it */
+    self->item  = item;
+    self->queue = &channel->senders;
+    queuePush( &channel->senders, self );
+    return suspend( -1 );
+}
+
+int channelReceive( tChannel *channel, void **item, int timeout )
+{
+    tCoroutine  *self = gCurrent;
+    tCoroutine  *sender;
+    int          result;
+
+    sender = channel->senders.head;
+
+    if ( channel->count > 0 )
+    {
+        *item = channel->ring[channel->head];
+        channel->head = (channel->head + 1) % channel->capacity;
+        --channel->count;
+
+        /* there's room for a waiting sender's item now */
+        if ( sender != NULL )
+        {
+            channel->ring[(channel->head + channel->count++) % channel->capacity] = sender->item;
+            wake( sender, 0 );
+        }
+        return 0;
+    }
+
+    if ( sender != NULL )
+    {
+        /* unbuffered - take it straight from the sender */
+        *item = sender->item;
+        wake( sender, 0 );
+        return 0;
+    }
+
+    if ( channel->closed )
+    {
+        return EPIPE;
+    }
+    if ( timeout == 0 )
+    {
+        return ETIMEDOUT;
+    }
+    if ( self == NULL )
+    {
+        return EAGAIN;
+    }
+
+    self->queue = &channel->receivers;
+    queuePush( &channel->receivers, self );
+    result = suspend( timeout );
+    if ( result == 0 )
+    {
+        *item = self->item;
+    }
+    return result;
+}
+
+void coroutineStats( const tCoroutine *coroutine, tCoroutineStats *stats )
+{
+    size_t  resident;
+
+    *stats   = coroutine->stats;
+    resident = stackResident( coroutine->mapping );
+    if ( resident > stats->stackPeak )
+    {
+        stats->stackPeak = resident;
+    }
+}
+
+void coroutineTotals( tCoroutineTotals *totals )
+{
+    const tCoroutine       *coroutine;
+    const unsigned char    *mapping;
+
+    *totals = gTotals;
+
+    totals->stackResident = 0;
+    for ( coroutine = gAlive; coroutine != NULL; coroutine = coroutine->nextAlive )
+    {
+        totals->stackResident += stackResident( coroutine->mapping );
+    }
+    for ( mapping = gStackPool; mapping != NULL; mapping = *(unsigned char * const *)(mapping + gPageSize + gStackSize - sizeof(void *)) )
+    {
+        totals->stackResident += stackResident( mapping );
+    }
+}
+
+void coroutineLogStats( void )
+{
+    const tCoroutine   *coroutine;
+    tCoroutineStats     stats;
+    tCoroutineTotals    totals;
+    tTimerWheelStats    timers;
+
+    for ( coroutine = gAlive; coroutine != NULL; coroutine = coroutine->nextAlive )
+    {
+        coroutineStats( coroutine, &stats );
+        logInfo( "coroutine %s: %lu resumes, %llu us running, %lu waits (%lu timed out), %zu of %zu bytes of stack used",
+                 coroutine->name, stats.resumes, stats.runNs / 1000, stats.waits, stats.timeouts,
+                 stats.stackPeak, stats.stackSize );
+    }
+
+    coroutineTotals( &totals );
+    logInfo( "coroutines: %u alive, %lu spawned, %lu switches, %u stacks pooled, %zu KiB of stack mapped, %zu KiB resident",
+             totals.alive, totals.spawned, totals.switches, totals.stacksPooled,
+             totals.stackMapped / 1024, totals.stackResident / 1024 );
+
+    timerWheelStats( gTimers, &timers );
+    logInfo( "coroutine timers: %u pending, %lu started, %lu expired, %lu cancelled, %lu cascaded, %zu KiB pooled",
+             timers.pending, timers.started, timers.expired, timers.cancelled, timers.cascaded, timers.pooled / 1024 );
+}
+
+#include "logging-epilogue.h"
@@ -0,0 +1,97 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timerwheel.h"
+
+/*
+    Stackful coroutines for the background loop.
+
+    Each coroutine runs on its own small mmap()ed stack, with a guard page
+    below it, taken from a pool. Coroutines switch only when they wait - for
+    an fd, a timer, a channel, or just to yield - so there's no locking
+    between them. One scheduler per process, driven by coroutineRun() on the
+    thread that called coroutineInit().
+*/
+
+typedef struct sCoroutine   tCoroutine;
+typedef struct sChannel     tChannel;
+
+typedef void (*fpCoroutine)( void *context );
+
+/* counters for tuning, per coroutine */
+typedef struct {
+    unsigned long       resumes;        /* times it was switched to */
+    unsigned long       waits;          /* times it waited for an fd, timer or channel */
+    unsigned long       timeouts;       /* waits that ended with a timeout */
+    unsigned long long  runNs;          /* total time spent running */
+    size_t              stackSize;      /* usable stack */
+    size_t              stackPeak;      /* high water mark of stack use, to the page */
+} tCoroutineStats;
+
+/* counters for tuning, for the whole scheduler */
+typedef struct {
+    unsigned int        alive;          /* coroutines that haven't finished */
+    unsigned long       spawned;
+    unsigned long       switches;
+    unsigned int        stacksPooled;   /* free stacks, ready for reuse */
+    size_t              stackMapped;    /* address space, including guard pages */
+    size_t              stackResident;  /* of which is actually in memory */
+} tCoroutineTotals;
+
+/* set up the scheduler. stackSize 0 picks the default. Returns 0 on success */
+int     coroutineInit( size_t stackSize );
+
+/* start a coroutine. It runs the next time the scheduler gets a chance. NULL on failure.
+   The handle is valid until the coroutine returns from entry */
+tCoroutine *    coroutineSpawn( const char *name, fpCoroutine entry, void *context );
+
+/* run everything that's ready, then wait up to timeout ms (-1 for ever) for
+   something else to be. Returns the number of coroutines still alive */
+unsigned int    coroutineRun( int timeout );
+
+/* the scheduler's timing wheel, with 1 ms ticks, for timers that call something
+   rather than wake a coroutine - per-key timeouts, retries, leases. They're called
+   from the scheduler, not a coroutine, so mustn't wait */
+tTimerWheel *   coroutineTimers( void );
+
+/* the coroutine that's running, or NULL if called from the scheduler */
+tCoroutine *    coroutineSelf( void );
+
+/* let everything else that's ready have a turn */
+void    coroutineYield( void );
+
+/* wait until fd has one of the (EPOLL...) events, or for timeout ms (-1 for ever).
+   Returns the events, 0 on a timeout or -1 with errno set */
+int     coroutineAwaitFd( int fd, uint32_t events, int timeout );
+
+/* wait for ms */
+void    coroutineSleep( unsigned int ms );
+
+/* a queue of pointers, holding up to capacity of them. 0 makes the sender wait for a receiver */
+tChannel *  channelCreate( unsigned int capacity );
+
+/* wake everyone waiting, and make further sends fail. Receivers can still drain it */
+void    channelClose( tChannel *channel );
+
+/* free a closed channel, once no one is waiting on it */
+void    channelDestroy( tChannel *channel );
+
+/* queue item, waiting for room if need be. Returns 0, EPIPE if closed, or EAGAIN
+   if it would have to wait and isn't called from a coroutine */
+int     channelSend( tChannel *channel, void *item );
+
+/* take the next item, waiting up to timeout ms (-1 for ever) for one. Returns 0,
+   ETIMEDOUT, EPIPE if it's closed & empty, or EAGAIN as for channelSend */
+int     channelReceive( tChannel *channel, void **item, int timeout );
+
+/* the counters */
+void    coroutineStats( const tCoroutine *coroutine, tCoroutineStats *stats );
+void    coroutineTotals( tCoroutineTotals *totals );
+
+/* log the counters for every live coroutine, and the totals */
+void    coroutineLogStats( void );
+
+#endif //COROUTINE_H
@@ -0,0 +1,662 @@
+/*
+    Always-on, crash-surviving flight recorder for log statements.
+
+    Records are fixed size, claimed with a single atomic increment of the ring
+    head, and marked complete by publishing their sequence number. The format
+    string isn't copied - just its offset from an anchor in this executable -
+    and the arguments are packed as raw values, so recording costs a fraction
+    of actually formatting the message. Strings are copied, truncated to fit.
+
+    Which kind of value each argument is comes from the format, which is only
+    parsed the first time its site is recorded. The pid is cached, and reset
+    after a fork, and timestamps come from the coarse clock - the ring's order
+    is exact, so they only have to place records in time.
+
+    The ring is MAP_SHARED, so it lands in the page cache even if the process
+    dies. A fatal signal handler notes the signal in the ring's header first.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "flightrecorder.h"
+
+#include "logging.h"    /* our logging support */
+
+#define kFlightMagic        "FLIGHT1"
+#define kFlightRecordSize   128
+#define kFlightRecords      16384   /* a power of two - 2 MiB of records */
+#define kFlightHeaderSize   4096
+#define kFlightMaxArgs      48      /* argument kinds cached per site - more than a record has room for */
+
+typedef struct {
+    char            magic[8];
+    unsigned int    recordSize;
+    unsigned int    recordCount;
+    long long       fingerprint;    /* identifies the executable that wrote the ring */
+    atomic_ullong   head;           /* total records ever claimed */
+    atomic_int      dumpedSignal;   /* non-zero if a process died with a fatal signal */
+    atomic_int      dumpedPid;
+} tFlightHeader;
+
+typedef struct {
+    atomic_ullong       seq;        /* index + 1 once the record is complete */
+    unsigned long long  timestamp;  /* CLOCK_REALTIME, in ns */
+    long long           format;     /* offset of the format string from gFlightAnchor */
+    int                 pid;
+    unsigned short      line;
+    unsigned char       scope;
+    unsigned char       priority;
+    unsigned char       argc;       /* number of arguments packed into args */
+    unsigned char       args[kFlightRecordSize - 33];
+} tFlightRecord;
+
+/* the kinds of argument a printf conversion can consume */
+typedef enum {
+    kArgNone,       /* %m */
+    kArgInt,
+    kArgLong,
+    kArgDouble,
+    kArgPointer,
+    kArgString,
+    kArgSkip,       /* %n - consumed, not recorded */
+    kArgUnknown,    /* can't safely go any further */
+    kArgEnd         /* ends a site's list of arguments */
+} eFlightArg;
+
+/* the arguments a site's format consumes, in order. '*' widths & precisions are kArgInts */
+typedef struct {
+    const char     *format;
+    unsigned char   kinds[kFlightMaxArgs + 1];
+} tFlightSite;
+
+int                     gLogFlightRecorder = 0;
+
+static const char       gFlightAnchor[] = "flight recorder";
+static tFlightHeader *  gFlight = NULL;
+static tFlightRecord *  gFlightRecords = NULL;
+static size_t           gFlightSize = 0;
+static pid_t            gFlightPid = 0;
+static tFlightSite **   gFlightSites[kMaxLogScope];    /* each site's arguments, once it's been recorded */
+
+static const int        kFatalSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, 0 };
+
+static const char *     kPriorityNames[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+void _logFlight( unsigned int scope, unsigned int site, unsigned int priority, unsigned int line, const char *format, ... )
+                            __attribute__((no_instrument_function));
+void _vlogFlight( unsigned int scope, unsigned int site, unsigned int priority, unsigned int line, const char *format, va_list vaptr )
+                            __attribute__((no_instrument_function));
+
+static const char *nextConversion( const char *format, const char **end, eFlightArg *kind, int *stars )
+                            __attribute__((no_instrument_function));
+static void parseArguments( const char *format, unsigned char *kinds )
+                            __attribute__((no_instrument_function));
+static const unsigned char *siteArguments( unsigned int scope, unsigned int site, const char *format, unsigned char *scratch )
+                            __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+
+/* the same executable always puts the anchor & _logFlight the same distance apart */
+static long long flightFingerprint( void )
+{
+    return (long long)((intptr_t)&_logFlight - (intptr_t)gFlightAnchor);
+}
+
+/*
+    Find the next conversion in a printf format, skipping '%%'. Returns a pointer
+    to its '%', or NULL if there are no more. *end is set to just past it, *kind
+    to the kind of argument it consumes, and *stars to the number of int
+    arguments consumed first by '*' widths and precisions.
+*/
+static const char *nextConversion( const char *format, const char **end, eFlightArg *kind, int *stars )
+{
+    const char *p;
+    int         longs;
+
+    for ( p = strchr( format, '%' ); p != NULL && p[1] == '%'; p = strchr( p + 2, '%' ) )
+    { /* skip literal percent signs */ }
+
+    if ( p == NULL )
+    {
+        return NULL;
+    }
+
+    format = p + 1;
+    *stars = 0;
+    longs  = 0;
+
+    while ( *format != '\0' && strchr( "-+ #0'I", *format ) != NULL ) ++format;
+
+    if ( *format == '*' ) { ++*stars; ++format; }
+    while ( *format >= '0' && *format <= '9' ) ++format;
+
+    if ( *format == '.' )
+    {
+        ++format;
+        if ( *format == '*' ) { ++*stars; ++format; }
+        while ( *format >= '0' && *format <= '9' ) ++format;
+    }
+
+    for ( ; *format != '\0' && strchr( "hlLqjzt", *format ) != NULL; ++format )
+    {
+        if ( *format != 'h' ) ++longs;
+        if ( *format == 'L' ) longs = 99; /* long double */
+    }
+
+    switch ( *format )
+    {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        *kind = (longs == 0) ? kArgInt : (longs < 99 ? kArgLong : kArgUnknown);
+        break;
+
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        *kind = (longs == 0) ? kArgDouble : kArgUnknown;
+        break;
+
+    case 's':
+        *kind = (longs == 0) ? kArgString : kArgUnknown;
+        break;
+
+    case 'p':   *kind = kArgPointer;    break;
+    case 'n':   *kind = kArgSkip;       break;
+    case 'm':   *kind = kArgNone;       break;
+    default:    *kind = kArgUnknown;    break;
+    }
+
+    *end = (*format != '\0') ? format + 1 : format;
+    return p;
+}
+
+/* the kinds of argument format consumes, as far as it's safe to go, ending with kArgEnd */
+static void parseArguments( const char *format, unsigned char *kinds )
+{
+    const char *end;
+    eFlightArg  kind;
+    int         stars, count;
+
+    count = 0;
+    while ( (format = nextConversion( format, &end, &kind, &stars )) != NULL && kind != kArgUnknown )
+    {
+        for ( ; stars > 0 && count < kFlightMaxArgs; --stars )
+        {
+            kinds[count++] = kArgInt;
+        }
+        if ( kind != kArgNone && count < kFlightMaxArgs )
+        {
+            kinds[count++] = kind;
+        }
+        format = end;
+    }
+    kinds[count] = kArgEnd;
+}
+
+/* a site's argument kinds, parsed the first time it's recorded. Parsed into scratch if they can't be cached */
+static const unsigned char *siteArguments( unsigned int scope, unsigned int site, const char *format, unsigned char *scratch )
+{
+    tFlightSite    *parsed, *expected;
+
+    if ( scope >= kMaxLogScope || gFlightSites[scope] == NULL || site >= gLog[scope].max )
+    {
+        parseArguments( format, scratch );
+        return scratch;
+    }
+
+    parsed = __atomic_load_n( &gFlightSites[scope][site], __ATOMIC_ACQUIRE );
+    if ( parsed == NULL )
+    {
+        parsed = malloc( sizeof(tFlightSite) );
+        if ( parsed == NULL )
+        {
+            parseArguments( format, scratch );
+            return scratch;
+        }
+        parsed->format = format;
+        parseArguments( format, parsed->kinds );
+
+        expected = NULL;
+        if ( !__atomic_compare_exchange_n( &gFlightSites[scope][site], &expected, parsed, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+        {
+            /* another thread beat us to it */
+            free( parsed );
+            parsed = expected;
+        }
+    }
+
+    /* a site normally has a literal format. If it doesn't, don't trust the cache */
+    if ( parsed->format != format )
+    {
+        parseArguments( format, scratch );
+        return scratch;
+    }
+    return parsed->kinds;
+}
+
+void _vlogFlight( unsigned int scope, unsigned int site, unsigned int priority, unsigned int line, const char *format, va_list vaptr )
+{
+    tFlightRecord          *record;
+    struct timespec         now;
+    const unsigned char    *kinds;
+    unsigned char           scratch[kFlightMaxArgs + 1];
+    const char             *str;
+    unsigned long long      pos;
+    long long               value;
+    double                  number;
+    size_t                  used, len;
+
+    if ( gFlight == NULL )
+    {
+        return;
+    }
+
+    kinds = siteArguments( scope, site, format, scratch );
+
+    pos    = atomic_fetch_add_explicit( &gFlight->head, 1, memory_order_relaxed );
+    record = &gFlightRecords[pos & (kFlightRecords - 1)];
+
+    /* invalidate it while it's being rewritten */
+    atomic_store_explicit( &record->seq, 0, memory_order_relaxed );
+
+    clock_gettime( CLOCK_REALTIME_COARSE, &now );
+    record->timestamp = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->format    = (long long)((intptr_t)format - (intptr_t)gFlightAnchor);
+    record->pid       = gFlightPid;
+    record->line      = line;
+    record->scope     = scope;
+    record->priority  = priority;
+    record->argc      = 0;
+
+    used = 0;
+    for ( ; *kinds != kArgEnd; ++kinds )
+    {
+        switch ( *kinds )
+        {
+        case kArgInt:
+        case kArgLong:
+        case kArgPointer:
+            if ( used + sizeof(value) > sizeof(record->args) ) goto full;
+            if      ( *kinds == kArgInt )  value = va_arg( vaptr, int );
+            else if ( *kinds == kArgLong ) value = va_arg( vaptr, long long );
+            else                           value = (long long)(intptr_t)va_arg( vaptr, void * );
+            memcpy( &record->args[used], &value, sizeof(value) );
+            used += sizeof(value);
+            break;
+
+        case kArgDouble:
+            if ( used + sizeof(number) > sizeof(record->args) ) goto full;
+            number = va_arg( vaptr, double );
+            memcpy( &record->args[used], &number, sizeof(number) );
+            used += sizeof(number);
+            break;
+
+        case kArgString:
+            /* a length byte, then as much of the string as will fit */
+            if ( used + 2 > sizeof(record->args) ) goto full;
+            str = va_arg( vaptr, const char * );
+            if ( str == NULL ) str = "(null)";
+            len = strnlen( str, sizeof(record->args) - used - 1 );
+            record->args[used++] = (unsigned char)len;
+            memcpy( &record->args[used], str, len );
+            used += len;
+            break;
+
+        case kArgSkip:
+            (void)va_arg( vaptr, void * );
+            continue;
+
+        default:
+            goto full;
+        }
+        ++record->argc;
+    }
+
+full:
+    atomic_store_explicit( &record->seq, pos + 1, memory_order_release );
+}
+
+void _logFlight( unsigned int scope, unsigned int site, unsigned int priority, unsigned int line, const char *format, ... )
+{
+    va_list vaptr;
+
+    va_start( vaptr, format );
+    _vlogFlight( scope, site, priority, line, format, vaptr );
+    va_end( vaptr );
+}
+
+/* a forked child has a pid of its own */
+static void flightForked( void )
+{
+    gFlightPid = getpid();
+}
+
+/* note which signal killed us in the ring's header, then die as we would have anyway */
+static void fatalSignal( int signal )
+{
+    if ( gFlight != NULL )
+    {
+        atomic_store( &gFlight->dumpedPid, getpid() );
+        atomic_store( &gFlight->dumpedSignal, signal );
+        msync( gFlight, gFlightSize, MS_ASYNC );
+    }
+    raise( signal ); /* SA_RESETHAND restored the default action */
+}
+
+/* if the previous ring records a crash, keep it out of harm's way */
+static void preserveCrashedRing( const char *path )
+{
+    tFlightHeader   header;
+    char            saved[4096];
+    int             fd;
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return;
+    }
+
+    if ( read( fd, &header, sizeof(header) ) == sizeof(header)
+      && memcmp( header.magic, kFlightMagic, sizeof(kFlightMagic) ) == 0
+      && header.dumpedSignal != 0 )
+    {
+        snprintf( saved, sizeof(saved), "%s.crashed", path );
+        if ( rename( path, saved ) == 0 )
+        {
+            logWarning( "flight recorder from a crashed process saved as \"%s\"", saved );
+        }
+    }
+    close( fd );
+}
+
+int flightRecorderStart( const char *path )
+{
+    static int          registered = 0;
+    struct sigaction    action;
+    tFlightSite       **sites;
+    void               *ring;
+    size_t              count;
+    int                 fd, i;
+
+    preserveCrashedRing( path );
+
+    gFlightSize = kFlightHeaderSize + kFlightRecords * sizeof(tFlightRecord);
+
+    fd = open( path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640 );
+    if ( fd < 0 || ftruncate( fd, gFlightSize ) < 0 )
+    {
+        logError( "unable to create flight recorder \"%s\" (%s [%d])", path, strerror(errno), errno );
+        if ( fd >= 0 ) close( fd );
+        return errno;
+    }
+
+    ring = mmap( NULL, gFlightSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( ring == MAP_FAILED )
+    {
+        logError( "unable to map flight recorder \"%s\" (%s [%d])", path, strerror(errno), errno );
+        return errno;
+    }
+
+    gFlight        = ring;
+    gFlightRecords = (tFlightRecord *)((char *)ring + kFlightHeaderSize);
+
+    /* somewhere to cache each site's argument kinds. Without it, they're parsed every time */
+    if ( gFlightSites[0] == NULL )
+    {
+        for ( count = 0, i = 0; i < kMaxLogScope; ++i )
+        {
+            count += gLog[i].max;
+        }
+        sites = calloc( count, sizeof(*sites) );
+        for ( i = 0; sites != NULL && i < kMaxLogScope; ++i )
+        {
+            gFlightSites[i] = sites;
+            sites += gLog[i].max;
+        }
+    }
+
+    gFlightPid = getpid();
+    if ( !registered )
+    {
+        pthread_atfork( NULL, NULL, &flightForked );
+        registered = 1;
+    }
+
+    memcpy( gFlight->magic, kFlightMagic, sizeof(kFlightMagic) );
+    gFlight->recordSize  = sizeof(tFlightRecord);
+    gFlight->recordCount = kFlightRecords;
+    gFlight->fingerprint = flightFingerprint();
+
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = &fatalSignal;
+    action.sa_flags   = SA_RESETHAND | SA_NODEFER | SA_ONSTACK;   /* a coroutine's stack overflow needs the alternate stack */
+    sigemptyset( &action.sa_mask );
+    for ( i = 0; kFatalSignals[i] != 0; ++i )
+    {
+        sigaction( kFatalSignals[i], &action, NULL );
+    }
+
+    gLogFlightRecorder = 1;
+
+    logInfo( "flight recorder: %u records in \"%s\"", kFlightRecords, path );
+
+    return 0;
+}
+
+void flightRecorderStop( void )
+{
+    gLogFlightRecorder = 0;
+
+    if ( gFlight != NULL )
+    {
+        munmap( gFlight, gFlightSize );
+        gFlight        = NULL;
+        gFlightRecords = NULL;
+    }
+}
+
+/* reformat one record's message, one conversion at a time */
+static void decodeMessage( const tFlightRecord *record, char *msg, size_t size )
+{
+    const char     *format, *start, *end;
+    const unsigned char *arg;
+    char            spec[256], str[256];
+    eFlightArg      kind;
+    size_t          len, used;
+    long long       value;
+    double          number;
+    int             stars, star[2], argc, i;
+
+    format = gFlightAnchor + record->format;
+    arg    = record->args;
+    argc   = record->argc;
+    used   = 0;
+    msg[0] = '\0';
+
+    /* each piece is the literal text up to & including one conversion, formatted on its own */
+    while ( used < size - 1 && (start = nextConversion( format, &end, &kind, &stars )) != NULL )
+    {
+        len = (size_t)(end - format);
+        if ( len >= sizeof(spec) || argc < stars + (kind != kArgNone && kind != kArgSkip) )
+        {
+            break;
+        }
+        memcpy( spec, format, len );
+        spec[len] = '\0';
+
+        for ( i = 0; i < stars; ++i, --argc, arg += sizeof(value) )
+        {
+            memcpy( &value, arg, sizeof(value) );
+            star[i] = (int)value;
+        }
+
+        switch ( kind )
+        {
+        case kArgNone:
+        case kArgSkip:
+            /* %m & %n aren't reproducible, so show them as-is */
+            len = (size_t)(start - format);
+            snprintf( &msg[used], size - used, "%.*s%.*s", (int)len, format, (int)(end - start), start );
+            break;
+
+        case kArgInt:
+        case kArgLong:
+        case kArgPointer:
+            memcpy( &value, arg, sizeof(value) );
+            arg += sizeof(value);
+            if ( stars == 0 )
+            {
+                if ( kind == kArgInt )          snprintf( &msg[used], size - used, spec, (int)value );
+                else if ( kind == kArgLong )    snprintf( &msg[used], size - used, spec, value );
+                else                            snprintf( &msg[used], size - used, spec, (void *)(intptr_t)value );
+            }
+            else if ( stars == 1 )
+            {
+                if ( kind == kArgInt )          snprintf( &msg[used], size - used, spec, star[0], (int)value );
+                else if ( kind == kArgLong )    snprintf( &msg[used], size - used, spec, star[0], value );
+                else                            snprintf( &msg[used], size - used, spec, star[0], (void *)(intptr_t)value );
+            }
+            else
+            {
+                if ( kind == kArgInt )          snprintf( &msg[used], size - used, spec, star[0], star[1], (int)value );
+                else if ( kind == kArgLong )    snprintf( &msg[used], size - used, spec, star[0], star[1], value );
+                else                            snprintf( &msg[used], size - used, spec, star[0], star[1], (void *)(intptr_t)value );
+            }
+            break;
+
+        case kArgDouble:
+            memcpy( &number, arg, sizeof(number) );
+            arg += sizeof(number);
+            if ( stars == 0 )       snprintf( &msg[used], size - used, spec, number );
+            else if ( stars == 1 )  snprintf( &msg[used], size - used, spec, star[0], number );
+            else                    snprintf( &msg[used], size - used, spec, star[0], star[1], number );
+            break;
+
+        case kArgString:
+            len = *arg++;
+            memcpy( str, arg, len );
+            str[len] = '\0';
+            arg += len;
+            if ( stars == 0 )       snprintf( &msg[used], size - used, spec, str );
+            else if ( stars == 1 )  snprintf( &msg[used], size - used, spec, star[0], str );
+            else                    snprintf( &msg[used], size - used, spec, star[0], star[1], str );
+            break;
+
+        default:
+            break;
+        }
+
+        if ( kind != kArgNone && kind != kArgSkip )
+        {
+            --argc;
+        }
+        used  += strlen( &msg[used] );
+        format = end;
+    }
+
+    if ( start != NULL )
+    { /* ran out of recorded arguments */
+        snprintf( &msg[used], size - used, "%.*s...", (int)(start - format), format );
+    }
+    else
+    { /* the tail can only contain literal text & '%%' */
+        snprintf( &msg[used], size - used, format, 0 );
+    }
+}
+
+int flightRecorderDump( const char *path, FILE *out )
+{
+    const tFlightHeader    *header;
+    const tFlightRecord    *records, *record;
+    struct stat             info;
+    struct tm               when;
+    char                    msg[1024], stamp[32];
+    unsigned long long      head, first, i;
+    time_t                  seconds;
+    void                   *ring;
+    int                     fd;
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 || fstat( fd, &info ) < 0 || (size_t)info.st_size < kFlightHeaderSize )
+    {
+        logError( "unable to read flight recorder \"%s\" (%s [%d])", path, strerror(errno), errno );
+        if ( fd >= 0 ) close( fd );
+        return errno ? errno : EINVAL;
+    }
+
+    ring = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( ring == MAP_FAILED )
+    {
+        logError( "unable to map flight recorder \"%s\" (%s [%d])", path, strerror(errno), errno );
+        return errno;
+    }
+
+    header  = ring;
+    records = (const tFlightRecord *)((const char *)ring + kFlightHeaderSize);
+
+    if ( memcmp( header->magic, kFlightMagic, sizeof(kFlightMagic) ) != 0
+      || header->recordSize != sizeof(tFlightRecord)
+      || header->recordCount != kFlightRecords
+      || (size_t)info.st_size < kFlightHeaderSize + kFlightRecords * sizeof(tFlightRecord) )
+    {
+        logError( "\"%s\" isn't a flight recorder", path );
+        munmap( ring, info.st_size );
+        return EINVAL;
+    }
+    if ( header->fingerprint != flightFingerprint() )
+    {
+        logError( "\"%s\" was recorded by a different build of %s", path, gExecName );
+        munmap( ring, info.st_size );
+        return EINVAL;
+    }
+
+    if ( header->dumpedSignal != 0 )
+    {
+        fprintf( out, "### process %d died with signal %d (%s)\n", header->dumpedPid, header->dumpedSignal, strsignal( header->dumpedSignal ) );
+    }
+
+    head  = header->head;
+    first = (head > kFlightRecords) ? head - kFlightRecords : 0;
+
+    for ( i = first; i < head; ++i )
+    {
+        record = &records[i & (kFlightRecords - 1)];
+        if ( record->seq != i + 1 || record->scope >= kMaxLogScope )
+        {
+            continue; /* incomplete, or already overwritten */
+        }
+
+        decodeMessage( record, msg, sizeof(msg) );
+
+        seconds = record->timestamp / 1000000000ULL;
+        localtime_r( &seconds, &when );
+        strftime( stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &when );
+
+        fprintf( out, "%s.%06llu [%d] %-7s %s:%u: %s\n", stamp, (record->timestamp / 1000ULL) % 1000000ULL,
+                 record->pid, kPriorityNames[record->priority & 7], logScopeNames[record->scope], record->line, msg );
+    }
+
+    munmap( ring, info.st_size );
+
+    return 0;
+}
+
+#include "logging-epilogue.h"
@@ -0,0 +1,22 @@
+#ifndef FLIGHTRECORDER_H
+#define FLIGHTRECORDER_H
+
+#include <stdio.h>
+
+/*
+    Always-on flight recorder. Every log site, including those filtered out by
+    the current log level, writes a compact binary record into a file-backed
+    ring, which survives the process crashing. Decode it afterwards with
+    flightRecorderDump, using the same executable that wrote it.
+*/
+
+/* map the ring at path, and start recording */
+int     flightRecorderStart( const char *path );
+
+/* stop recording, and unmap the ring */
+void    flightRecorderStop( void );
+
+/* decode the ring in path as text, written to out */
+int     flightRecorderDump( const char *path, FILE *out );
+
+#endif //FLIGHTRECORDER_H
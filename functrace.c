@@ -0,0 +1,611 @@
+/*
+    Selective function tracing.
+
+    The filter is compiled into a bitmap over the executable's code, with a
+    bit per 4 bytes. Function entry points are always further apart than
+    that, so each function has a bit of its own. Scopes and address ranges
+    set a run of bits; names are looked up in the executable's own symbol
+    table, which unlike dladdr() knows about static functions too. It's
+    indexed by address the first time it's needed, so addrToString() can
+    name static functions as well.
+
+    A new filter is compiled on the side, then copied over the live bitmap
+    a word at a time. Another thread might briefly see a mix of the old and
+    new filters, which doesn't matter for tracing, and the bitmap is never
+    freed, so there's no need for anything stronger.
+
+    Counts live in an open addressed table, keyed by function, that's filled
+    in lock free. Each thread keeps a short stack of when the functions it's
+    in were entered, to time them.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <elf.h>
+#include <link.h>       /* dl_iterate_phdr() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "functrace.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kTraceCountSlots    4096    /* functions that can be counted, a power of two */
+#define kTraceStackDepth    64      /* calls deep that can be timed, per thread */
+#define kTraceStatsTop      20      /* functions logged by functionTraceLogStats */
+#define kTraceDelimiters    ", \t\n"
+
+typedef struct {
+    void *              fn;             /* NULL if the slot's free */
+    unsigned long       calls;
+    unsigned long long  ns;
+} tTraceCount;
+
+typedef struct {
+    void *              fn;
+    unsigned long long  entered;        /* CLOCK_MONOTONIC, in ns */
+} tTraceFrame;
+
+typedef struct {
+    uintptr_t           start;          /* where it is in memory */
+    size_t              size;
+    const char *        name;
+} tFunction;
+
+int                 gFunctionTraceCounting = kTraceCountOff;
+uint64_t *          gFunctionTraceBitmap = NULL;
+uintptr_t           gFunctionTraceText = 0;
+uintptr_t           gFunctionTraceTextSize = 0;
+
+static uintptr_t    gLoadBase = 0;          /* what nm's addresses are relative to */
+static uint64_t *   gBitmapStore = NULL;    /* the live bitmap, once there's been a filter */
+static size_t       gBitmapWords = 0;
+
+static tFunction *          gFunctions = NULL;      /* sorted by address */
+static size_t               gFunctionCount = 0;
+static pthread_once_t       gFunctionsLoaded = PTHREAD_ONCE_INIT;
+
+static tTraceCount *        gTraceCounts = NULL;
+
+static __thread tTraceFrame     tTraceStack[kTraceStackDepth];
+static __thread unsigned int    tTraceDepth = 0;
+
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+static unsigned long long nowNs( void )             __attribute__((no_instrument_function));
+static int findText( struct dl_phdr_info *info, size_t size, void *context )
+                                                    __attribute__((no_instrument_function));
+static int loadText( void )                         __attribute__((no_instrument_function));
+static int compareFunctions( const void *left, const void *right )
+                                                    __attribute__((no_instrument_function));
+static void loadSymbols( void )                     __attribute__((no_instrument_function));
+static void markRange( uint64_t *bitmap, uintptr_t from, uintptr_t to )
+                                                    __attribute__((no_instrument_function));
+static int markFunction( uint64_t *bitmap, const char *name )
+                                                    __attribute__((no_instrument_function));
+static int findScope( const char *name, uintptr_t *from, uintptr_t *to )
+                                                    __attribute__((no_instrument_function));
+static int parseFilter( const char *filter, uint64_t *bitmap )
+                                                    __attribute__((no_instrument_function));
+static tTraceCount * countSlot( void *fn )          __attribute__((no_instrument_function));
+static int compareCounts( const void *left, const void *right )
+                                                    __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+
+static unsigned long long nowNs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* dl_iterate_phdr() starts with the executable, so only the first call is wanted */
+static int findText( struct dl_phdr_info *info, size_t UNUSED(size), void * UNUSED(context) )
+{
+    uintptr_t   start, end;
+    int         i;
+
+    start = UINTPTR_MAX;
+    end   = 0;
+    for ( i = 0; i < info->dlpi_phnum; ++i )
+    {
+        if ( info->dlpi_phdr[i].p_type == PT_LOAD && (info->dlpi_phdr[i].p_flags & PF_X) != 0 )
+        {
+            if ( info->dlpi_addr + info->dlpi_phdr[i].p_vaddr < start )
+            {
+                start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+            }
+            if ( info->dlpi_addr + info->dlpi_phdr[i].p_vaddr + info->dlpi_phdr[i].p_memsz > end )
+            {
+                end = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr + info->dlpi_phdr[i].p_memsz;
+            }
+        }
+    }
+
+    if ( start < end )
+    {
+        gLoadBase              = info->dlpi_addr;
+        gFunctionTraceText     = start;
+        gFunctionTraceTextSize = end - start;
+    }
+    return 1;
+}
+
+/* where the executable's code is, and how big a bitmap covers it. 0 on success */
+static int loadText( void )
+{
+    if ( gFunctionTraceTextSize == 0 )
+    {
+        dl_iterate_phdr( findText, NULL );
+        if ( gFunctionTraceTextSize == 0 )
+        {
+            logError( "unable to find the executable's code" );
+            return ENOENT;
+        }
+        gBitmapWords = (gFunctionTraceTextSize + 255) / 256;
+    }
+    return 0;
+}
+
+/* by address */
+static int compareFunctions( const void *left, const void *right )
+{
+    const tFunction    *l = left;
+    const tFunction    *r = right;
+
+    return (l->start > r->start) - (l->start < r->start);
+}
+
+/*
+    Map the executable, and index the functions in its symbol table. Falls
+    back to the dynamic symbols if it's been stripped. The names are left
+    where they are, so it stays mapped
+*/
+static void loadSymbols( void )
+{
+    const Elf64_Ehdr   *header;
+    const Elf64_Shdr   *sections;
+    const Elf64_Sym    *symbols;
+    const char         *image, *names;
+    struct stat         st;
+    size_t              count, i;
+    int                 fd, section, wanted;
+
+    if ( loadText() != 0 )
+    {
+        return;
+    }
+
+    fd = open( "/proc/self/exe", O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        logWarning( "unable to read our own symbols (%s [%d])", strerror(errno), errno );
+        return;
+    }
+    image = MAP_FAILED;
+    if ( fstat( fd, &st ) == 0 && (size_t)st.st_size >= sizeof(Elf64_Ehdr) )
+    {
+        image = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    }
+    close( fd );
+    if ( image == MAP_FAILED )
+    {
+        logWarning( "unable to map our own symbols" );
+        return;
+    }
+
+    header = (const Elf64_Ehdr *)image;
+    if ( memcmp( header->e_ident, ELFMAG, SELFMAG ) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64
+      || header->e_shoff == 0 || header->e_shoff + header->e_shnum * sizeof(Elf64_Shdr) > (size_t)st.st_size )
+    {
+        logWarning( "unable to make sense of our own symbols" );
+        munmap( (void *)image, st.st_size );
+        return;
+    }
+    sections = (const Elf64_Shdr *)(image + header->e_shoff);
+
+    symbols = NULL;
+    count   = 0;
+    names   = NULL;
+    for ( wanted = SHT_SYMTAB; symbols == NULL && wanted != 0; wanted = (wanted == SHT_SYMTAB ? SHT_DYNSYM : 0) )
+    {
+        for ( section = 0; section < header->e_shnum; ++section )
+        {
+            if ( sections[section].sh_type == (Elf64_Word)wanted && sections[section].sh_link < header->e_shnum )
+            {
+                symbols = (const Elf64_Sym *)(image + sections[section].sh_offset);
+                count   = sections[section].sh_size / sizeof(Elf64_Sym);
+                names   = image + sections[sections[section].sh_link].sh_offset;
+                break;
+            }
+        }
+    }
+
+    gFunctions = calloc( count + 1, sizeof(tFunction) );
+    if ( gFunctions == NULL )
+    {
+        return;
+    }
+    for ( i = 0; i < count; ++i )
+    {
+        if ( ELF64_ST_TYPE( symbols[i].st_info ) == STT_FUNC && symbols[i].st_value != 0 )
+        {
+            gFunctions[gFunctionCount].start = gLoadBase + symbols[i].st_value;
+            gFunctions[gFunctionCount].size  = symbols[i].st_size;
+            gFunctions[gFunctionCount].name  = &names[symbols[i].st_name];
+            ++gFunctionCount;
+        }
+    }
+    qsort( gFunctions, gFunctionCount, sizeof(tFunction), compareFunctions );
+}
+
+const char * functionTraceName( void *address )
+{
+    size_t  low, high, middle;
+
+    pthread_once( &gFunctionsLoaded, loadSymbols );
+
+    /* the last function starting at or before address */
+    low  = 0;
+    high = gFunctionCount;
+    while ( low < high )
+    {
+        middle = (low + high) / 2;
+        if ( gFunctions[middle].start <= (uintptr_t)address )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if ( low == 0 || (uintptr_t)address >= gFunctions[low - 1].start + (gFunctions[low - 1].size != 0 ? gFunctions[low - 1].size : 1) )
+    {
+        return NULL;
+    }
+    return gFunctions[low - 1].name;
+}
+
+/* trace functions starting anywhere from 'from' to 'to', inclusive */
+static void markRange( uint64_t *bitmap, uintptr_t from, uintptr_t to )
+{
+    uintptr_t   bit;
+
+    if ( to < gFunctionTraceText || from >= gFunctionTraceText + gFunctionTraceTextSize )
+    {
+        return;
+    }
+    from = (from > gFunctionTraceText ? from - gFunctionTraceText : 0) >> 2;
+    to   = (to - gFunctionTraceText < gFunctionTraceTextSize ? to - gFunctionTraceText : gFunctionTraceTextSize - 1) >> 2;
+
+    for ( bit = from; bit <= to; ++bit )
+    {
+        bitmap[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+/* trace every function called name. Returns how many there were */
+static int markFunction( uint64_t *bitmap, const char *name )
+{
+    size_t  i;
+    int     found;
+
+    pthread_once( &gFunctionsLoaded, loadSymbols );
+
+    found = 0;
+    for ( i = 0; i < gFunctionCount; ++i )
+    {
+        if ( strcmp( gFunctions[i].name, name ) == 0 )
+        {
+            markRange( bitmap, gFunctions[i].start, gFunctions[i].start );
+            ++found;
+        }
+    }
+    return found;
+}
+
+/*
+    A scope's code runs from just after the end of whichever scope was linked
+    before it, to its own end marker. Returns 0 if there's no such scope
+*/
+static int findScope( const char *name, uintptr_t *from, uintptr_t *to )
+{
+    uintptr_t   end, other;
+    int         i;
+
+    for ( i = 0; i < kMaxLogScope && strcmp( logScopeNames[i], name ) != 0; ++i )
+    { /* look it up */ }
+    if ( i == kMaxLogScope )
+    {
+        return 0;
+    }
+
+    end   = (uintptr_t)logScopeEnds[i];
+    *from = gFunctionTraceText;
+    *to   = end;
+    for ( i = 0; i < kMaxLogScope; ++i )
+    {
+        other = (uintptr_t)logScopeEnds[i];
+        if ( other < end && other + 1 > *from )
+        {
+            *from = other + 1;
+        }
+    }
+    return 1;
+}
+
+/* compile filter into bitmap, or with bitmap NULL, just check it. 0 or EINVAL */
+static int parseFilter( const char *filter, uint64_t *bitmap )
+{
+    char               *terms, *term, *saved, *end;
+    unsigned long long  from, to;
+    uintptr_t           scopeFrom, scopeTo;
+    int                 result;
+
+    terms = strdup( filter );
+    if ( terms == NULL )
+    {
+        return ENOMEM;
+    }
+
+    result = 0;
+    for ( term = strtok_r( terms, kTraceDelimiters, &saved ); term != NULL && result == 0; term = strtok_r( NULL, kTraceDelimiters, &saved ) )
+    {
+        if ( strcmp( term, "all" ) == 0 )
+        {
+            if ( bitmap != NULL )
+            {
+                memset( bitmap, 0xff, gBitmapWords * sizeof(uint64_t) );
+            }
+        }
+        else if ( strncmp( term, "fn:", 3 ) == 0 && term[3] != '\0' )
+        {
+            if ( bitmap != NULL && markFunction( bitmap, &term[3] ) == 0 )
+            {
+                logWarning( "trace filter: there's no function called %s", &term[3] );
+            }
+        }
+        else if ( strncmp( term, "scope:", 6 ) == 0 )
+        {
+            if ( !findScope( &term[6], &scopeFrom, &scopeTo ) )
+            {
+                logError( "trace filter: there's no scope called \"%s\"", &term[6] );
+                result = EINVAL;
+            }
+            else if ( bitmap != NULL )
+            {
+                markRange( bitmap, scopeFrom, scopeTo );
+            }
+        }
+        else if ( strncmp( term, "addr:", 5 ) == 0 )
+        {
+            from = strtoull( &term[5], &end, 16 );
+            to   = (*end == '-') ? strtoull( end + 1, &end, 16 ) : 0;
+            if ( end == &term[5] || *end != '\0' || to < from )
+            {
+                logError( "trace filter: \"%s\" isn't an address range, like addr:1200-12ff", term );
+                result = EINVAL;
+            }
+            else if ( bitmap != NULL )
+            {
+                markRange( bitmap, gLoadBase + from, gLoadBase + to );
+            }
+        }
+        else
+        {
+            logError( "trace filter: don't know what \"%s\" is - expected fn:, scope:, addr: or all", term );
+            result = EINVAL;
+        }
+    }
+
+    free( terms );
+    return result;
+}
+
+int functionTraceFilterValid( const char *filter )
+{
+    return (filter != NULL) ? parseFilter( filter, NULL ) : 0;
+}
+
+int functionTraceFilter( const char *filter )
+{
+    uint64_t   *bitmap;
+    size_t      i;
+    int         result;
+
+    if ( filter == NULL )
+    {
+        __atomic_store_n( &gFunctionTraceBitmap, NULL, __ATOMIC_RELEASE );
+        return 0;
+    }
+
+    result = loadText();
+    if ( result != 0 )
+    {
+        return result;
+    }
+
+    bitmap = calloc( gBitmapWords, sizeof(uint64_t) );
+    if ( gBitmapStore == NULL )
+    {
+        gBitmapStore = calloc( gBitmapWords, sizeof(uint64_t) );
+    }
+    if ( bitmap == NULL || gBitmapStore == NULL )
+    {
+        free( bitmap );
+        logError( "unable to allocate the trace filter" );
+        return ENOMEM;
+    }
+
+    result = parseFilter( filter, bitmap );
+    if ( result == 0 )
+    {
+        for ( i = 0; i < gBitmapWords; ++i )
+        {
+            __atomic_store_n( &gBitmapStore[i], bitmap[i], __ATOMIC_RELAXED );
+        }
+        __atomic_store_n( &gFunctionTraceBitmap, gBitmapStore, __ATOMIC_RELEASE );
+    }
+    free( bitmap );
+
+    return result;
+}
+
+void functionTraceCounting( eTraceCount count )
+{
+    if ( count != kTraceCountOff && gTraceCounts == NULL )
+    {
+        gTraceCounts = calloc( kTraceCountSlots, sizeof(tTraceCount) );
+        if ( gTraceCounts == NULL )
+        {
+            logError( "unable to allocate the function trace counts" );
+            count = kTraceCountOff;
+        }
+    }
+    gFunctionTraceCounting = count;
+}
+
+/* fn's slot, claiming one if it hasn't got one yet. NULL if the table's full */
+static tTraceCount * countSlot( void *fn )
+{
+    unsigned int    slot, probes;
+    void           *expected;
+
+    slot = (unsigned int)(((uintptr_t)fn * 0x9E3779B97F4A7C15ULL) >> 52) & (kTraceCountSlots - 1);
+    for ( probes = 0; probes < kTraceCountSlots; ++probes )
+    {
+        expected = __atomic_load_n( &gTraceCounts[slot].fn, __ATOMIC_ACQUIRE );
+        if ( expected == fn )
+        {
+            return &gTraceCounts[slot];
+        }
+        if ( expected == NULL
+          && (__atomic_compare_exchange_n( &gTraceCounts[slot].fn, &expected, fn, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) || expected == fn) )
+        {
+            return &gTraceCounts[slot];
+        }
+        slot = (slot + 1) & (kTraceCountSlots - 1);
+    }
+    return NULL;
+}
+
+void _functionTraceEnter( void *fn )
+{
+    tTraceCount    *count;
+
+    count = countSlot( fn );
+    if ( count != NULL )
+    {
+        __atomic_fetch_add( &count->calls, 1, __ATOMIC_RELAXED );
+    }
+
+    if ( tTraceDepth < kTraceStackDepth )
+    {
+        tTraceStack[tTraceDepth].fn      = fn;
+        tTraceStack[tTraceDepth].entered = nowNs();
+    }
+    ++tTraceDepth;
+}
+
+void _functionTraceExit( void *fn )
+{
+    tTraceCount    *count;
+    unsigned int    depth;
+
+    if ( tTraceDepth > kTraceStackDepth )
+    {
+        --tTraceDepth;      /* too deep to have been timed */
+        return;
+    }
+
+    /* normally it's the top one, unless a coroutine switched part way through */
+    for ( depth = tTraceDepth; depth > 0 && tTraceStack[depth - 1].fn != fn; --depth )
+    { /* look for it */ }
+    if ( depth == 0 )
+    {
+        return;
+    }
+    tTraceDepth = depth - 1;
+
+    count = countSlot( fn );
+    if ( count != NULL )
+    {
+        __atomic_fetch_add( &count->ns, nowNs() - tTraceStack[depth - 1].entered, __ATOMIC_RELAXED );
+    }
+}
+
+/* most time first */
+static int compareCounts( const void *left, const void *right )
+{
+    const tTraceCount  *l = left;
+    const tTraceCount  *r = right;
+
+    return (l->ns < r->ns) - (l->ns > r->ns);
+}
+
+void functionTraceLogStats( void )
+{
+    tTraceCount    *counts;
+    char            scratch[24];
+    unsigned int    i, n;
+
+    if ( gTraceCounts == NULL )
+    {
+        return;
+    }
+
+    counts = malloc( kTraceCountSlots * sizeof(tTraceCount) );
+    if ( counts == NULL )
+    {
+        return;
+    }
+
+    n = 0;
+    for ( i = 0; i < kTraceCountSlots; ++i )
+    {
+        counts[n].fn = __atomic_load_n( &gTraceCounts[i].fn, __ATOMIC_ACQUIRE );
+        if ( counts[n].fn != NULL )
+        {
+            counts[n].calls = __atomic_load_n( &gTraceCounts[i].calls, __ATOMIC_RELAXED );
+            counts[n].ns    = __atomic_load_n( &gTraceCounts[i].ns, __ATOMIC_RELAXED );
+            ++n;
+        }
+    }
+    qsort( counts, n, sizeof(tTraceCount), compareCounts );
+
+    logInfo( "function trace: %u functions counted%s", n, n > kTraceStatsTop ? ", the most expensive:" : "" );
+    for ( i = 0; i < n && i < kTraceStatsTop; ++i )
+    {
+        logInfo( "  %-32s %10lu calls %12.3f ms %10.0f ns/call",
+                 addrToString( counts[i].fn, scratch ),
+                 counts[i].calls, (double)counts[i].ns / 1e6,
+                 counts[i].calls != 0 ? (double)counts[i].ns / counts[i].calls : 0.0 );
+    }
+
+    free( counts );
+}
+
+#include "logging-epilogue.h"
@@ -0,0 +1,85 @@
+#ifndef FUNCTRACE_H
+#define FUNCTRACE_H
+
+#include <stdint.h>
+
+/*
+    Selective function tracing, for builds with -finstrument-functions.
+
+    A filter picks which functions logFunctionTraceOn() traces. It's a list
+    of terms, separated by commas or spaces, any of which may match:
+
+        fn:<name>           functions called name - static ones too, unless
+                            the executable has been stripped
+        scope:<name>        every function in <name>.c (see logScopeNames)
+        addr:<from>-<to>    functions starting in that range of hex addresses,
+                            as nm shows them (i.e. relative to the executable)
+        all                 everything
+
+    Until a filter is set, or after setting NULL, everything is traced. An
+    empty filter traces nothing.
+
+    Filters are compiled into a bitmap with a bit per 4 bytes of the
+    executable's code, so a function that isn't traced costs one lookup.
+    Scopes are found from a marker each file ends with (logging-epilogue.h),
+    so rely on functions being laid out in the order they're defined, as
+    they are in unoptimized builds.
+
+    Traced functions can also be counted, with the time spent in them. The
+    time is wall clock, including whatever the function called, and is
+    approximate when a coroutine switches part way through.
+*/
+
+typedef enum { kTraceCountOff, kTraceCountAlso, kTraceCountOnly } eTraceCount;
+
+/* compile and apply a filter. NULL traces everything. Returns 0, or EINVAL
+   (having logged why) and leaves the current filter in place */
+int     functionTraceFilter( const char *filter ) __attribute__((no_instrument_function));
+
+/* 0 if the filter would be accepted, otherwise EINVAL, having logged why */
+int     functionTraceFilterValid( const char *filter ) __attribute__((no_instrument_function));
+
+/* count calls to, and time, the traced functions - as well as logging them, or instead of */
+void    functionTraceCounting( eTraceCount count ) __attribute__((no_instrument_function));
+
+/* the name of the function address is in, from the executable's symbol table. NULL if there isn't one */
+const char *    functionTraceName( void *address ) __attribute__((no_instrument_function));
+
+/* log the most expensive of the functions counted so far */
+void    functionTraceLogStats( void ) __attribute__((no_instrument_function));
+
+/* private, for the inline functions & the instrumentation hooks. Please don't use directly! */
+extern int              gFunctionTraceEnabled;
+extern int              gFunctionTraceCounting;
+extern uint64_t *       gFunctionTraceBitmap;
+extern uintptr_t        gFunctionTraceText;
+extern uintptr_t        gFunctionTraceTextSize;
+
+void    _functionTraceEnter( void *fn ) __attribute__((no_instrument_function));
+void    _functionTraceExit( void *fn ) __attribute__((no_instrument_function));
+
+static inline int functionTraced( void *fn ) __attribute__((no_instrument_function));
+
+/* non-zero if calls to fn are to be traced */
+static inline int functionTraced( void *fn )
+{
+    uint64_t   *bitmap;
+    uintptr_t   offset;
+
+    if ( !gFunctionTraceEnabled )
+    {
+        return 0;
+    }
+
+    bitmap = __atomic_load_n( &gFunctionTraceBitmap, __ATOMIC_ACQUIRE );
+    if ( bitmap == NULL )
+    {
+        return 1;
+    }
+
+    offset = (uintptr_t)fn - gFunctionTraceText;
+    return offset < gFunctionTraceTextSize
+        && (__atomic_load_n( &bitmap[offset >> 8], __ATOMIC_RELAXED ) >> ((offset >> 2) & 63)) & 1;
+}
+
+#endif //FUNCTRACE_H
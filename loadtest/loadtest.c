@@ -0,0 +1,992 @@
+/*
+    loadtest - end-to-end load test for the daemon
+
+    Runs the daemon flat out (tick = 0) in each of its modes, with its log
+    going into a FIFO that we drain, so the log sink is never the bottleneck.
+    For each mode it measures:
+
+      - startup:    exec to the first pass of the background loop
+      - throughput: passes of the background loop per second, and the log
+                    lines & bytes they produce
+      - cost:       CPU time and read/write syscalls per pass (from /proc),
+                    and every syscall per pass if strace is available (-S)
+      - memory:     resident set size of the process running the loop
+      - latency:    percentiles for reloads via SIGHUP and via the config
+                    file changing, and (when supervised) for the master
+                    restarting a killed worker - all while under load
+      - shutdown:   how long SIGTERM takes. The daemon has to exit cleanly -
+                    its loop stopping and the log being closed - or the
+                    mode fails
+
+    Each mode's results are appended to a JSON-lines file, tagged with a
+    build id, and compared with the last result for the same mode.
+
+    Usage: loadtest [options] path/to/daemon
+           loadtest -c before.jsonl after.jsonl
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#define kReadyTimeoutMs     10000   /* give up if the loop hasn't started by then */
+#define kEventTimeoutMs     5000    /* ... or a reload or restart hasn't happened */
+#define kShutdownTimeoutMs  3000    /* SIGKILL if SIGTERM hasn't worked by then */
+#define kOperationGapMs     20      /* between reloads, so inotify doesn't coalesce them */
+#define kMaxSamples         1000
+
+typedef enum { kModeForeground, kModeDaemon, kModeSupervised, kModeCount } eMode;
+
+static const char * kModeNames[kModeCount] = { "foreground", "daemon", "supervised" };
+
+typedef struct {
+    unsigned int    count;
+    double          sample[kMaxSamples];
+} tSamples;
+
+typedef struct {
+    unsigned long   syscr;      /* read syscalls */
+    unsigned long   syscw;      /* write syscalls */
+    unsigned long   cpuTicks;   /* user + system */
+} tUsage;
+
+typedef struct {
+    double          startupMs;
+    double          passesPerSec;
+    double          linesPerSec;
+    double          megabytesPerSec;
+    double          cpuUsPerPass;
+    double          readsPerPass;
+    double          writesPerPass;
+    double          straceSyscallsPerPass;  /* < 0 if it wasn't measured */
+    long            rssKb;
+    long            hwmKb;
+    long            masterRssKb;            /* < 0 if there's no master */
+    tSamples        reloadSighup;
+    tSamples        reloadInotify;
+    tSamples        restart;
+    double          shutdownMs;
+    bool            cleanShutdown;
+    bool            failed;
+    const char     *failure;
+} tResults;
+
+/* options */
+static unsigned int     gSeconds    = 5;
+static unsigned int     gReloads    = 20;
+static unsigned int     gRestarts   = 5;
+static unsigned int     gLevel      = 6;        /* info - needed to see the loop & reloads */
+static bool             gStrace     = false;
+static const char *     gBuild      = "unknown";
+static const char *     gResultFile = NULL;
+static bool             gModes[kModeCount] = { true, true, true };
+
+/* the run in progress */
+static char             gDir[]      = "/tmp/loadtest.XXXXXX";
+static char             gFifo[PATH_MAX];
+static char             gConfig[PATH_MAX];
+static int              gLogFd      = -1;
+static int              gLogHold    = -1;       /* our own write end, so the FIFO never reads as EOF */
+static char             gLine[65536];
+static size_t           gLineLength = 0;
+
+/* what the log has told us so far */
+static unsigned long    gPasses     = 0;
+static unsigned long    gLines      = 0;
+static unsigned long    gBytes      = 0;
+static unsigned long    gReloadsSeen = 0;
+static unsigned long    gStopsSeen  = 0;        /* the background loop has returned */
+static pid_t            gDaemonPid  = 0;        /* from "daemon process: <pid>" */
+static double           gLastPassAt = 0;
+static double           gLastReloadAt = 0;
+
+
+static double nowMs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void sleepMs( unsigned int ms )
+{
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while ( nanosleep( &delay, &delay ) != 0 && errno == EINTR )
+    { /* keep sleeping */ }
+}
+
+static void processLine( const char *line, double at )
+{
+    const char  *found;
+
+    ++gLines;
+
+    if ( strstr( line, "zzzz..." ) != NULL )
+    {
+        ++gPasses;
+        gLastPassAt = at;
+    }
+    else if ( strstr( line, "configuration reloaded" ) != NULL )
+    {
+        ++gReloadsSeen;
+        gLastReloadAt = at;
+    }
+    else if ( strstr( line, "stopping the background loop" ) != NULL )
+    {
+        ++gStopsSeen;
+    }
+    else if ( (found = strstr( line, "daemon process: " )) != NULL )
+    {
+        gDaemonPid = atoi( found + strlen( "daemon process: " ) );
+    }
+}
+
+/* read whatever the daemon has logged, waiting up to timeout ms for some to arrive */
+static void pump( int timeout )
+{
+    struct pollfd   fifo = { gLogFd, POLLIN, 0 };
+    char            buffer[65536];
+    char           *start, *end;
+    ssize_t         length;
+    double          at;
+
+    if ( poll( &fifo, 1, timeout ) <= 0 )
+    {
+        return;
+    }
+
+    while ( (length = read( gLogFd, buffer, sizeof(buffer) )) > 0 )
+    {
+        at      = nowMs();
+        gBytes += length;
+
+        for ( start = buffer; (end = memchr( start, '\n', &buffer[length] - start )) != NULL; start = end + 1 )
+        {
+            if ( gLineLength + (end - start) < sizeof(gLine) )
+            {
+                memcpy( &gLine[gLineLength], start, end - start );
+                gLineLength += end - start;
+            }
+            gLine[gLineLength] = '\0';
+            processLine( gLine, at );
+            gLineLength = 0;
+        }
+
+        /* keep the beginning of a partial line for next time */
+        if ( gLineLength + (&buffer[length] - start) < sizeof(gLine) )
+        {
+            memcpy( &gLine[gLineLength], start, &buffer[length] - start );
+            gLineLength += &buffer[length] - start;
+        }
+    }
+}
+
+/* pump the log until *counter passes target. Returns false on a timeout */
+static bool waitForCount( const unsigned long *counter, unsigned long target, int timeout )
+{
+    double  deadline;
+
+    deadline = nowMs() + timeout;
+    while ( *counter < target )
+    {
+        if ( nowMs() > deadline )
+        {
+            return false;
+        }
+        pump( 10 );
+    }
+    return true;
+}
+
+static void drain( void )
+{
+    gLineLength = 0;
+    pump( 0 );
+}
+
+/* true until the process has gone, reaping it if it's ours (we're a subreaper, so daemons are ours too) */
+static bool isRunning( pid_t pid )
+{
+    while ( waitpid( -1, NULL, WNOHANG ) > 0 )
+    { /* reap anything that's finished */ }
+
+    return pid > 0 && kill( pid, 0 ) == 0;
+}
+
+/* a child of parent that isn't exclude, or 0 if there isn't one */
+static pid_t findChild( pid_t parent, pid_t exclude )
+{
+    DIR            *proc;
+    struct dirent  *entry;
+    char            path[64], stat[512], *close;
+    FILE           *file;
+    pid_t           pid, ppid, found;
+
+    found = 0;
+    proc  = opendir( "/proc" );
+    if ( proc == NULL )
+    {
+        return 0;
+    }
+    while ( found == 0 && (entry = readdir( proc )) != NULL )
+    {
+        pid = atoi( entry->d_name );
+        if ( pid <= 0 || pid == exclude )
+        {
+            continue;
+        }
+        snprintf( path, sizeof(path), "/proc/%d/stat", pid );
+        file = fopen( path, "r" );
+        if ( file == NULL )
+        {
+            continue;
+        }
+        /* the name is in parentheses, and may contain anything */
+        if ( fgets( stat, sizeof(stat), file ) != NULL
+          && (close = strrchr( stat, ')' )) != NULL
+          && sscanf( close + 1, " %*c %d", &ppid ) == 1
+          && ppid == parent
+          && close[2] != 'Z' )
+        {
+            found = pid;
+        }
+        fclose( file );
+    }
+    closedir( proc );
+    return found;
+}
+
+static void readUsage( pid_t pid, tUsage *usage )
+{
+    char            path[64], line[1024], *close;
+    FILE           *file;
+    unsigned long   utime, stime;
+
+    memset( usage, 0, sizeof(*usage) );
+
+    snprintf( path, sizeof(path), "/proc/%d/io", pid );
+    file = fopen( path, "r" );
+    if ( file != NULL )
+    {
+        while ( fgets( line, sizeof(line), file ) != NULL )
+        {
+            sscanf( line, "syscr: %lu", &usage->syscr );
+            sscanf( line, "syscw: %lu", &usage->syscw );
+        }
+        fclose( file );
+    }
+
+    snprintf( path, sizeof(path), "/proc/%d/stat", pid );
+    file = fopen( path, "r" );
+    if ( file != NULL )
+    {
+        /* utime & stime are the 14th & 15th fields, counting from the pid */
+        if ( fgets( line, sizeof(line), file ) != NULL
+          && (close = strrchr( line, ')' )) != NULL
+          && sscanf( close + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime ) == 2 )
+        {
+            usage->cpuTicks = utime + stime;
+        }
+        fclose( file );
+    }
+}
+
+/* a "Vm..." line from /proc/<pid>/status, in kB. -1 if it can't be read */
+static long readMemory( pid_t pid, const char *field )
+{
+    char    path[64], line[256];
+    FILE   *file;
+    long    value;
+
+    value = -1;
+    snprintf( path, sizeof(path), "/proc/%d/status", pid );
+    file = fopen( path, "r" );
+    if ( file != NULL )
+    {
+        while ( fgets( line, sizeof(line), file ) != NULL )
+        {
+            if ( strncmp( line, field, strlen( field ) ) == 0 && line[strlen( field )] == ':' )
+            {
+                value = atol( &line[strlen( field ) + 1] );
+                break;
+            }
+        }
+        fclose( file );
+    }
+    return value;
+}
+
+/* change something harmless in the config file, via a rename so the daemon only sees it once */
+static int writeConfig( unsigned int generation )
+{
+    char    scratch[PATH_MAX + 8];
+    FILE   *file;
+
+    snprintf( scratch, sizeof(scratch), "%s.new", gConfig );
+    file = fopen( scratch, "w" );
+    if ( file == NULL )
+    {
+        return errno;
+    }
+    fprintf( file, "tick = 0\n" );
+    fprintf( file, "logframesize = %u\n", 1024 + (generation & 1) );
+    if ( fclose( file ) != 0 || rename( scratch, gConfig ) != 0 )
+    {
+        return errno;
+    }
+    return 0;
+}
+
+static pid_t startDaemon( const char *daemon, eMode mode )
+{
+    const char *argv[16];
+    char        level[8], output[PATH_MAX + 16];
+    int         argc, fd;
+    pid_t       pid;
+
+    snprintf( level, sizeof(level), "%u", gLevel );
+
+    argc = 0;
+    argv[argc++] = daemon;
+    argv[argc++] = "--config";
+    argv[argc++] = gConfig;
+    argv[argc++] = "--logfile";
+    argv[argc++] = gFifo;
+    argv[argc++] = "--debug";
+    argv[argc++] = level;
+    if ( mode == kModeForeground )
+    {
+        argv[argc++] = "--foreground";
+    }
+    if ( mode == kModeSupervised )
+    {
+        argv[argc++] = "--supervise";
+    }
+    argv[argc] = NULL;
+
+    fflush( NULL );
+    pid = fork();
+    if ( pid == 0 )
+    {
+        /* anything logged before the log file is opened goes here */
+        snprintf( output, sizeof(output), "%s/%s.out", gDir, kModeNames[mode] );
+        fd = open( output, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( fd >= 0 )
+        {
+            dup2( fd, STDOUT_FILENO );
+            dup2( fd, STDERR_FILENO );
+            close( fd );
+        }
+        close( gLogFd );
+        close( gLogHold );
+        execv( daemon, (char * const *)argv );
+        _exit( 127 );
+    }
+    return pid;
+}
+
+/* the duration of the throughput window, under strace. Returns every syscall per pass, or -1 */
+static double straceWindow( pid_t pid )
+{
+    char            output[PATH_MAX + 16], target[16], line[256];
+    unsigned long   passes, calls;
+    double          percent, seconds;
+    pid_t           tracer;
+    FILE           *file;
+    double          result;
+
+    snprintf( output, sizeof(output), "%s/strace.txt", gDir );
+    snprintf( target, sizeof(target), "%d", pid );
+
+    tracer = fork();
+    if ( tracer == 0 )
+    {
+        close( STDOUT_FILENO );
+        close( STDERR_FILENO );
+        execlp( "strace", "strace", "-f", "-c", "-q", "-o", output, "-p", target, (char *)NULL );
+        _exit( 127 );
+    }
+    if ( tracer < 0 )
+    {
+        return -1;
+    }
+
+    sleepMs( 200 ); /* let it attach */
+    drain();
+    passes = gPasses;
+    waitForCount( &gPasses, ULONG_MAX, gSeconds * 1000 );
+    passes = gPasses - passes;
+
+    kill( tracer, SIGINT );
+    waitpid( tracer, NULL, 0 );
+
+    result = -1;
+    file = fopen( output, "r" );
+    if ( file != NULL )
+    {
+        while ( fgets( line, sizeof(line), file ) != NULL )
+        {
+            /* "% time  seconds  usecs/call  calls  errors  syscall", ending with a total */
+            if ( strstr( line, " total" ) != NULL
+              && sscanf( line, "%lf %lf %*u %lu", &percent, &seconds, &calls ) == 3
+              && passes > 0 )
+            {
+                result = (double)calls / passes;
+            }
+        }
+        fclose( file );
+    }
+    return result;
+}
+
+static int compareDoubles( const void *a, const void *b )
+{
+    double  x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile. The samples are sorted as a side effect */
+static double percentile( tSamples *samples, double p )
+{
+    unsigned int    rank;
+
+    if ( samples->count == 0 )
+    {
+        return -1;
+    }
+    qsort( samples->sample, samples->count, sizeof(double), compareDoubles );
+    rank = (unsigned int)(p / 100.0 * samples->count + 0.999999);
+    return samples->sample[(rank > 0 ? rank : 1) - 1];
+}
+
+static void addSample( tSamples *samples, double value )
+{
+    if ( samples->count < kMaxSamples )
+    {
+        samples->sample[samples->count++] = value;
+    }
+}
+
+static void runMode( const char *daemon, eMode mode, tResults *results )
+{
+    tUsage          before, after;
+    pid_t           child, top, runner, next;
+    unsigned long   passes, lines, bytes, target;
+    double          start, elapsed, trigger;
+    unsigned int    i;
+
+    memset( results, 0, sizeof(*results) );
+    results->masterRssKb           = -1;
+    results->straceSyscallsPerPass = -1;
+
+    gPasses = gLines = gBytes = gReloadsSeen = gStopsSeen = 0;
+    gDaemonPid = 0;
+    writeConfig( 0 );
+    drain();
+
+    /* startup */
+    start = nowMs();
+    child = startDaemon( daemon, mode );
+    if ( child < 0 || !waitForCount( &gPasses, 1, kReadyTimeoutMs ) )
+    {
+        results->failed  = true;
+        results->failure = "the background loop never started";
+        top = (mode == kModeForeground) ? child : gDaemonPid;
+        goto shutdown;
+    }
+    results->startupMs = gLastPassAt - start;
+
+    /* which process is which */
+    top    = (mode == kModeForeground) ? child : gDaemonPid;
+    runner = (mode == kModeSupervised) ? findChild( top, 0 ) : top;
+    if ( top <= 0 || runner <= 0 )
+    {
+        results->failed  = true;
+        results->failure = "couldn't find the daemon's processes";
+        goto shutdown;
+    }
+
+    /* throughput */
+    sleepMs( 500 ); /* warm up */
+    drain();
+    readUsage( runner, &before );
+    passes = gPasses;
+    lines  = gLines;
+    bytes  = gBytes;
+    start  = nowMs();
+
+    waitForCount( &gPasses, ULONG_MAX, gSeconds * 1000 );
+
+    elapsed = (nowMs() - start) / 1000.0;
+    readUsage( runner, &after );
+    passes = gPasses - passes;
+    lines  = gLines - lines;
+    bytes  = gBytes - bytes;
+
+    results->passesPerSec    = passes / elapsed;
+    results->linesPerSec     = lines / elapsed;
+    results->megabytesPerSec = bytes / elapsed / (1024 * 1024);
+    if ( passes > 0 )
+    {
+        results->cpuUsPerPass  = (after.cpuTicks - before.cpuTicks) * 1000000.0 / sysconf( _SC_CLK_TCK ) / passes;
+        results->readsPerPass  = (double)(after.syscr - before.syscr) / passes;
+        results->writesPerPass = (double)(after.syscw - before.syscw) / passes;
+    }
+
+    /* memory */
+    results->rssKb = readMemory( runner, "VmRSS" );
+    results->hwmKb = readMemory( runner, "VmHWM" );
+    if ( mode == kModeSupervised )
+    {
+        results->masterRssKb = readMemory( top, "VmRSS" );
+    }
+
+    if ( gStrace )
+    {
+        results->straceSyscallsPerPass = straceWindow( runner );
+    }
+
+    /* reloads, under load */
+    for ( i = 0; i < gReloads; ++i )
+    {
+        sleepMs( kOperationGapMs );
+        drain();
+        target  = gReloadsSeen + 1;
+        trigger = nowMs();
+        if ( i & 1 )
+        {
+            writeConfig( i );
+        }
+        else
+        {
+            kill( runner, SIGHUP );
+        }
+        if ( waitForCount( &gReloadsSeen, target, kEventTimeoutMs ) )
+        {
+            addSample( (i & 1) ? &results->reloadInotify : &results->reloadSighup, gLastReloadAt - trigger );
+        }
+    }
+
+    /* killed workers, under load */
+    for ( i = 0; mode == kModeSupervised && i < gRestarts; ++i )
+    {
+        trigger = nowMs();
+        kill( runner, SIGKILL );
+
+        /* once the old one has gone, anything new in the log is from its replacement */
+        while ( kill( runner, 0 ) == 0 && nowMs() - trigger < kEventTimeoutMs )
+        {
+            drain();
+            sleepMs( 1 );
+        }
+        drain();
+
+        next = 0;
+        while ( (next = findChild( top, runner )) == 0 && nowMs() - trigger < kEventTimeoutMs )
+        {
+            sleepMs( 1 );
+        }
+        if ( next == 0 || !waitForCount( &gPasses, gPasses + 1, kEventTimeoutMs ) )
+        {
+            results->failed  = true;
+            results->failure = "the master didn't restart a killed worker";
+            goto shutdown;
+        }
+        addSample( &results->restart, gLastPassAt - trigger );
+        runner = next;
+    }
+
+shutdown:
+    if ( top > 0 )
+    {
+        start = nowMs();
+        kill( top, SIGTERM );
+        while ( isRunning( top ) && nowMs() - start < kShutdownTimeoutMs )
+        {
+            drain();
+            sleepMs( 1 );
+        }
+        results->shutdownMs = nowMs() - start;
+        drain();
+
+        /* gone, having said so - not just killed by the signal */
+        results->cleanShutdown = !isRunning( top ) && gStopsSeen > 0;
+        if ( isRunning( top ) )
+        {
+            kill( top, SIGKILL );
+        }
+        if ( !results->cleanShutdown && !results->failed )
+        {
+            results->failed  = true;
+            results->failure = "SIGTERM didn't stop it cleanly";
+        }
+    }
+
+    /* make sure nothing's left behind - workers included */
+    while ( (next = findChild( getpid(), 0 )) != 0 )
+    {
+        kill( next, SIGKILL );
+        waitpid( next, NULL, 0 );
+    }
+    drain();
+}
+
+static void printSamples( FILE *file, const char *name, tSamples *samples )
+{
+    fprintf( file, ",\"%s\":{\"n\":%u,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+             name, samples->count,
+             percentile( samples, 50 ), percentile( samples, 90 ), percentile( samples, 99 ), percentile( samples, 100 ) );
+}
+
+static void printResults( FILE *file, eMode mode, tResults *results )
+{
+    char        stamp[32];
+    time_t      now;
+
+    now = time( NULL );
+    strftime( stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime( &now ) );
+
+    fprintf( file, "{\"build\":\"%s\",\"time\":\"%s\",\"mode\":\"%s\",\"level\":%u,\"seconds\":%u",
+             gBuild, stamp, kModeNames[mode], gLevel, gSeconds );
+    if ( results->failed )
+    {
+        fprintf( file, ",\"failed\":\"%s\"", results->failure );
+    }
+    fprintf( file, ",\"startup_ms\":%.3f,\"passes_per_sec\":%.1f,\"lines_per_sec\":%.1f,\"log_mb_per_sec\":%.3f",
+             results->startupMs, results->passesPerSec, results->linesPerSec, results->megabytesPerSec );
+    fprintf( file, ",\"cpu_us_per_pass\":%.3f,\"reads_per_pass\":%.3f,\"writes_per_pass\":%.3f",
+             results->cpuUsPerPass, results->readsPerPass, results->writesPerPass );
+    if ( results->straceSyscallsPerPass >= 0 )
+    {
+        fprintf( file, ",\"syscalls_per_pass\":%.3f", results->straceSyscallsPerPass );
+    }
+    fprintf( file, ",\"rss_kb\":%ld,\"hwm_kb\":%ld", results->rssKb, results->hwmKb );
+    if ( results->masterRssKb >= 0 )
+    {
+        fprintf( file, ",\"master_rss_kb\":%ld", results->masterRssKb );
+    }
+    printSamples( file, "reload_sighup_ms", &results->reloadSighup );
+    printSamples( file, "reload_inotify_ms", &results->reloadInotify );
+    if ( mode == kModeSupervised )
+    {
+        printSamples( file, "restart_ms", &results->restart );
+    }
+    fprintf( file, ",\"shutdown_ms\":%.3f,\"clean_shutdown\":%s}\n",
+             results->shutdownMs, results->cleanShutdown ? "true" : "false" );
+}
+
+/* a number from one of our own JSON lines - "key" or "key.p50". NAN-ish -1 if it's not there */
+static double jsonNumber( const char *line, const char *key )
+{
+    char        name[64];
+    const char *dot, *found;
+
+    dot = strchr( key, '.' );
+    snprintf( name, sizeof(name), "\"%.*s\":", (int)(dot != NULL ? dot - key : (int)strlen( key )), key );
+    found = strstr( line, name );
+    if ( found == NULL )
+    {
+        return -1;
+    }
+    found += strlen( name );
+    if ( dot != NULL )
+    {
+        snprintf( name, sizeof(name), "\"%s\":", dot + 1 );
+        found = strstr( found, name );
+        if ( found == NULL )
+        {
+            return -1;
+        }
+        found += strlen( name );
+    }
+    return strtod( found, NULL );
+}
+
+/* the build id from one of our own JSON lines */
+static void jsonBuild( const char *line, char *build, size_t size )
+{
+    const char *found;
+
+    snprintf( build, size, "?" );
+    found = strstr( line, "\"build\":\"" );
+    if ( found != NULL )
+    {
+        found += strlen( "\"build\":\"" );
+        snprintf( build, size, "%.*s", (int)strcspn( found, "\"" ), found );
+    }
+}
+
+/* show how one result compares with another for the same mode, metric by metric */
+static void compareResults( const char *previous, const char *current )
+{
+    static const char * keys[] = {
+        "startup_ms", "passes_per_sec", "lines_per_sec", "log_mb_per_sec",
+        "cpu_us_per_pass", "reads_per_pass", "writes_per_pass", "syscalls_per_pass",
+        "rss_kb", "hwm_kb", "master_rss_kb",
+        "reload_sighup_ms.p50", "reload_sighup_ms.p99", "reload_inotify_ms.p50", "reload_inotify_ms.p99",
+        "restart_ms.p50", "restart_ms.p99", "shutdown_ms", NULL
+    };
+    char    beforeBuild[128], afterBuild[128];
+    double  before, after;
+    int     i;
+
+    jsonBuild( previous, beforeBuild, sizeof(beforeBuild) );
+    jsonBuild( current, afterBuild, sizeof(afterBuild) );
+    printf( "    %-24s %22s %22s %14s %8s\n", "", beforeBuild, afterBuild, "delta", "change" );
+
+    for ( i = 0; keys[i] != NULL; ++i )
+    {
+        before = jsonNumber( previous, keys[i] );
+        after  = jsonNumber( current, keys[i] );
+        if ( before < 0 || after < 0 )
+        {
+            continue;
+        }
+        printf( "    %-24s %22.3f %22.3f %+14.3f %+7.1f%%\n", keys[i], before, after, after - before,
+                before != 0 ? (after - before) * 100.0 / before : 0.0 );
+    }
+}
+
+/* the last successful result for mode in path, if there is one */
+static bool lastResult( const char *path, eMode mode, char *result, size_t size )
+{
+    char   *line, modeKey[32];
+    size_t  length;
+    FILE   *file;
+
+    result[0] = '\0';
+    snprintf( modeKey, sizeof(modeKey), "\"mode\":\"%s\"", kModeNames[mode] );
+    file = fopen( path, "r" );
+    if ( file != NULL )
+    {
+        line   = NULL;
+        length = 0;
+        while ( getline( &line, &length, file ) > 0 )
+        {
+            if ( strstr( line, modeKey ) != NULL && strstr( line, "\"failed\"" ) == NULL )
+            {
+                snprintf( result, size, "%s", line );
+            }
+        }
+        free( line );
+        fclose( file );
+    }
+    return result[0] != '\0';
+}
+
+/* compare the last results for each mode in two files, e.g. from two builds */
+static int compareFiles( const char *beforePath, const char *afterPath )
+{
+    char    before[4096], after[4096];
+    eMode   mode;
+    int     compared;
+
+    compared = 0;
+    for ( mode = 0; mode < kModeCount; ++mode )
+    {
+        if ( gModes[mode] && lastResult( beforePath, mode, before, sizeof(before) ) && lastResult( afterPath, mode, after, sizeof(after) ) )
+        {
+            printf( "%s:\n", kModeNames[mode] );
+            compareResults( before, after );
+            ++compared;
+        }
+    }
+    if ( compared == 0 )
+    {
+        fprintf( stderr, "loadtest: no mode has results in both %s and %s\n", beforePath, afterPath );
+    }
+    return compared != 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void recordResults( eMode mode, tResults *results )
+{
+    char   *current, previous[4096];
+    size_t  size;
+    FILE   *file;
+
+    /* to the terminal, in the same form as the file */
+    file = open_memstream( &current, &size );
+    if ( file == NULL )
+    {
+        return;
+    }
+    printResults( file, mode, results );
+    fclose( file );
+    printf( "%s", current );
+
+    if ( gResultFile != NULL )
+    {
+        if ( lastResult( gResultFile, mode, previous, sizeof(previous) ) && !results->failed )
+        {
+            compareResults( previous, current );
+        }
+
+        file = fopen( gResultFile, "a" );
+        if ( file == NULL )
+        {
+            fprintf( stderr, "loadtest: can't append to %s (%s)\n", gResultFile, strerror( errno ) );
+        }
+        else
+        {
+            fputs( current, file );
+            fclose( file );
+        }
+    }
+    free( current );
+    fflush( stdout );
+}
+
+static void usage( void )
+{
+    fprintf( stderr,
+        "usage: loadtest [options] path/to/daemon\n"
+        "       loadtest [-m modes] -c before.jsonl after.jsonl\n"
+        "  -t seconds   length of the throughput window (default 5)\n"
+        "  -n count     reloads to time, alternating SIGHUP & config file changes (default 20)\n"
+        "  -k count     worker restarts to time, when supervised (default 5)\n"
+        "  -d level     the daemon's log level, 6 or 7 (default 6)\n"
+        "  -m modes     comma-separated: foreground,daemon,supervised (default all)\n"
+        "  -S           also count every syscall, using strace\n"
+        "  -b build     build id to tag the results with\n"
+        "  -o file      append results to file, and compare with the last ones there\n"
+        "  -c           don't run anything, just compare the last results for each mode in two files\n" );
+    exit( EXIT_FAILURE );
+}
+
+static void parseModes( char *list )
+{
+    char   *mode, *saved;
+    int     i;
+
+    memset( gModes, 0, sizeof(gModes) );
+    for ( mode = strtok_r( list, ",", &saved ); mode != NULL; mode = strtok_r( NULL, ",", &saved ) )
+    {
+        for ( i = 0; i < kModeCount && strcmp( mode, kModeNames[i] ) != 0; ++i )
+        { /* look it up */ }
+        if ( i == kModeCount )
+        {
+            usage();
+        }
+        gModes[i] = true;
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    char        daemon[PATH_MAX + 16];
+    tResults   *results;
+    int         option, failures;
+    eMode       mode;
+    bool        compare = false;
+
+    while ( (option = getopt( argc, argv, "t:n:k:d:m:Sb:o:c" )) != -1 )
+    {
+        switch ( option )
+        {
+        case 't': gSeconds    = atoi( optarg ); break;
+        case 'n': gReloads    = atoi( optarg ); break;
+        case 'k': gRestarts   = atoi( optarg ); break;
+        case 'd': gLevel      = atoi( optarg ); break;
+        case 'm': parseModes( optarg );         break;
+        case 'S': gStrace     = true;           break;
+        case 'b': gBuild      = optarg;         break;
+        case 'o': gResultFile = optarg;         break;
+        case 'c': compare     = true;           break;
+        default:  usage();
+        }
+    }
+    if ( compare )
+    {
+        if ( optind != argc - 2 )
+        {
+            usage();
+        }
+        return compareFiles( argv[optind], argv[optind + 1] );
+    }
+    if ( optind != argc - 1 || gSeconds == 0 || gLevel < 6 || gLevel > 7 || gReloads > kMaxSamples || gRestarts > kMaxSamples )
+    {
+        usage();
+    }
+
+    /* the daemon chdir()s to / */
+    if ( realpath( argv[optind], daemon ) == NULL )
+    {
+        fprintf( stderr, "loadtest: %s: %s\n", argv[optind], strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+
+    /* daemons become our children when their parent exits, so we can reap them */
+    prctl( PR_SET_CHILD_SUBREAPER, 1 );
+    signal( SIGPIPE, SIG_IGN );
+
+    if ( mkdtemp( gDir ) == NULL )
+    {
+        perror( "loadtest: mkdtemp" );
+        return EXIT_FAILURE;
+    }
+    snprintf( gFifo,   sizeof(gFifo),   "%s/log.fifo", gDir );
+    snprintf( gConfig, sizeof(gConfig), "%s/loadtest.conf", gDir );
+
+    if ( mkfifo( gFifo, 0600 ) != 0
+      || (gLogFd   = open( gFifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC )) < 0
+      || (gLogHold = open( gFifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC )) < 0 )
+    {
+        perror( "loadtest: log fifo" );
+        return EXIT_FAILURE;
+    }
+    fcntl( gLogFd, F_SETPIPE_SZ, 1024 * 1024 );
+
+    results  = malloc( sizeof(*results) );
+    failures = 0;
+    for ( mode = 0; results != NULL && mode < kModeCount; ++mode )
+    {
+        if ( gModes[mode] )
+        {
+            fprintf( stderr, "loadtest: %s mode...\n", kModeNames[mode] );
+            runMode( daemon, mode, results );
+            recordResults( mode, results );
+            failures += results->failed;
+        }
+    }
+    free( results );
+
+    /* keep the daemon's own output if something went wrong */
+    if ( failures == 0 )
+    {
+        for ( mode = 0; mode < kModeCount; ++mode )
+        {
+            snprintf( daemon, sizeof(daemon), "%s/%s.out", gDir, kModeNames[mode] );
+            unlink( daemon );
+        }
+        snprintf( daemon, sizeof(daemon), "%s/strace.txt", gDir );
+        unlink( daemon );
+        snprintf( daemon, sizeof(daemon), "%s.new", gConfig );
+        unlink( daemon );
+        unlink( gConfig );
+        unlink( gFifo );
+        rmdir( gDir );
+    }
+    else
+    {
+        fprintf( stderr, "loadtest: %d mode(s) failed - the daemon's output is in %s\n", failures, gDir );
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,502 @@
+/*
+    Streaming compression for the file log destination.
+
+    Writers append lines to the filling buffer under a mutex. When it reaches
+    the frame size (or has been waiting too long), it's swapped with the empty
+    one, and the compressor thread turns it into one self-contained frame.
+    Writers only wait if the compressor has fallen a whole frame behind.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#include "logcompress.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kFrameFlushMs   1000    /* compress a partial frame once its oldest line is this old */
+
+typedef struct {
+    char               *data;
+    size_t              length;
+    size_t              capacity;
+    unsigned long long  first;      /* CLOCK_REALTIME of the first & last lines, in ns */
+    unsigned long long  last;
+} tFrame;
+
+static pthread_mutex_t  gCompressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gCompressWork = PTHREAD_COND_INITIALIZER;  /* a frame is ready, or it's time to stop */
+static pthread_cond_t   gCompressDone = PTHREAD_COND_INITIALIZER;  /* the compressor has finished a frame */
+static pthread_t        gCompressor;
+
+static tFrame           gFrames[2];
+static tFrame *         gFilling = NULL;    /* being appended to by writers */
+static tFrame *         gReady = NULL;      /* handed to the compressor, or NULL */
+static int              gStopping = 0;
+static int              gRunning = 0;       /* the compressor thread is running in this process */
+
+static eLogCompression  gMethod = kCompressNone;
+static int              gLevel;
+static size_t           gFrameSize;
+static int              gOutput = -1;
+static FILE *           gIndex = NULL;
+
+static z_stream         gDeflate;
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *      gZstd = NULL;
+#endif
+static unsigned char *  gCompressed = NULL;
+static size_t           gCompressedCapacity = 0;
+
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+void logCompressWrite( const char *msg )
+                            __attribute__((no_instrument_function));
+
+unsigned int logCompressBacklog( void )
+                            __attribute__((no_instrument_function));
+
+static void * compressorThread( void *arg )
+                            __attribute__((no_instrument_function));
+
+static void compressFrame( tFrame *frame )
+                            __attribute__((no_instrument_function));
+
+static void lockOutput( short type )
+                            __attribute__((no_instrument_function));
+
+static unsigned long long nowNs( void )
+                            __attribute__((no_instrument_function));
+
+static int reserve( void **buf, size_t *capacity, size_t size )
+                            __attribute__((no_instrument_function));
+
+static int startCompressor( void )
+                            __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+
+static unsigned long long nowNs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+const char * logCompressSuffix( eLogCompression method )
+{
+    switch ( method )
+    {
+    case kCompressZlib: return ".gz";
+    case kCompressZstd: return ".zst";
+    default:            return "";
+    }
+}
+
+/* make sure buf can hold at least size bytes */
+static int reserve( void **buf, size_t *capacity, size_t size )
+{
+    void *grown;
+
+    if ( size > *capacity )
+    {
+        grown = realloc( *buf, size );
+        if ( grown == NULL )
+        {
+            return ENOMEM;
+        }
+        *buf      = grown;
+        *capacity = size;
+    }
+    return 0;
+}
+
+/*
+    Other processes can be appending to the same file - an unaggregated worker,
+    say, which writes through the descriptor it inherited. So the file is locked
+    while a frame is written & indexed. Record locks belong to the process, so
+    they keep the others out even though they share the descriptor.
+*/
+static void lockOutput( short type )
+{
+    struct flock    lock;
+
+    memset( &lock, 0, sizeof(lock) );
+    lock.l_type   = type;
+    lock.l_whence = SEEK_SET;   /* the whole file */
+    while ( fcntl( gOutput, F_SETLKW, &lock ) != 0 && errno == EINTR )
+    { /* try again */ }
+}
+
+/* compress a frame, write it out, then index it. Called by the compressor thread, without the lock */
+static void compressFrame( tFrame *frame )
+{
+    struct stat info;
+    size_t      bound, length;
+    ssize_t     written;
+    int         result;
+
+    if ( gMethod == kCompressZlib )
+    {
+        bound = deflateBound( &gDeflate, frame->length ) + 32;
+    }
+    else
+    {
+#ifdef HAVE_ZSTD
+        bound = ZSTD_compressBound( frame->length );
+#else
+        return;
+#endif
+    }
+
+    if ( reserve( (void **)&gCompressed, &gCompressedCapacity, bound ) != 0 )
+    {
+        return; /* not much we can do */
+    }
+
+    if ( gMethod == kCompressZlib )
+    {
+        /* a complete gzip member per frame, so each one can be decoded on its own */
+        deflateReset( &gDeflate );
+        gDeflate.next_in   = (unsigned char *)frame->data;
+        gDeflate.avail_in  = frame->length;
+        gDeflate.next_out  = gCompressed;
+        gDeflate.avail_out = bound;
+        result = deflate( &gDeflate, Z_FINISH );
+        if ( result != Z_STREAM_END )
+        {
+            return;
+        }
+        length = bound - gDeflate.avail_out;
+    }
+#ifdef HAVE_ZSTD
+    else
+    {
+        length = ZSTD_compressCCtx( gZstd, gCompressed, bound, frame->data, frame->length, gLevel );
+        if ( ZSTD_isError( length ) )
+        {
+            return;
+        }
+    }
+#endif
+
+    /* with the file locked, its size is where O_APPEND will put the frame */
+    lockOutput( F_WRLCK );
+    if ( fstat( gOutput, &info ) == 0 )
+    {
+        written = write( gOutput, gCompressed, length );
+        if ( written == (ssize_t)length )
+        {
+            fprintf( gIndex, "%lld\t%zu\t%zu\t%llu\t%llu\n", (long long)info.st_size, length, frame->length, frame->first, frame->last );
+            fflush( gIndex );
+        }
+    }
+    lockOutput( F_UNLCK );
+}
+
+static void * compressorThread( void * UNUSED(arg) )
+{
+    struct timespec deadline;
+    tFrame         *frame;
+
+    pthread_mutex_lock( &gCompressLock );
+
+    while ( 1 )
+    {
+        if ( gReady == NULL && !gStopping )
+        {
+            /* nothing full yet, so wait until there is, or the oldest line has waited long enough */
+            clock_gettime( CLOCK_REALTIME, &deadline );
+            deadline.tv_sec += kFrameFlushMs / 1000;
+            pthread_cond_timedwait( &gCompressWork, &gCompressLock, &deadline );
+
+            if ( gReady == NULL && gFilling->length > 0 && nowNs() - gFilling->first >= kFrameFlushMs * 1000000ULL )
+            {
+                gReady   = gFilling;
+                gFilling = (gFilling == &gFrames[0]) ? &gFrames[1] : &gFrames[0];
+            }
+        }
+
+        if ( gReady == NULL && gStopping )
+        {
+            if ( gFilling->length == 0 )
+            {
+                break;
+            }
+            gReady   = gFilling;
+            gFilling = (gFilling == &gFrames[0]) ? &gFrames[1] : &gFrames[0];
+        }
+
+        if ( gReady != NULL )
+        {
+            frame = gReady;
+            pthread_mutex_unlock( &gCompressLock );
+
+            compressFrame( frame );
+
+            pthread_mutex_lock( &gCompressLock );
+            frame->length = 0;
+            gReady = NULL;
+            pthread_cond_broadcast( &gCompressDone );
+        }
+    }
+
+    pthread_mutex_unlock( &gCompressLock );
+
+    return NULL;
+}
+
+/* start the compressor thread. Called with the lock held, or before anyone else can write */
+static int startCompressor( void )
+{
+    sigset_t    all, previous;
+    int         result;
+
+    /* leave signals to the rest of the process */
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &previous );
+    result = pthread_create( &gCompressor, NULL, &compressorThread, NULL );
+    pthread_sigmask( SIG_SETMASK, &previous, NULL );
+
+    gRunning = (result == 0);
+    return result;
+}
+
+/*
+    Threads don't survive a fork, and whatever was pending belongs to the parent,
+    which will write it out. So the child starts afresh, and starts its own
+    compressor when it next writes.
+*/
+static void compressorForked( void )
+{
+    pthread_mutex_init( &gCompressLock, NULL );
+    pthread_cond_init( &gCompressWork, NULL );
+    pthread_cond_init( &gCompressDone, NULL );
+
+    gFrames[0].length = 0;
+    gFrames[1].length = 0;
+    gReady   = NULL;
+    gRunning = 0;
+}
+
+void logCompressWrite( const char *msg )
+{
+    size_t  length;
+
+    length = strlen( msg );
+
+    pthread_mutex_lock( &gCompressLock );
+
+    if ( gFilling == NULL || (!gRunning && startCompressor() != 0) )
+    {
+        pthread_mutex_unlock( &gCompressLock );
+        return; /* drop it */
+    }
+
+    if ( gFilling->length + length + 1 > gFilling->capacity
+      && reserve( (void **)&gFilling->data, &gFilling->capacity, gFilling->length + length + 1 ) != 0 )
+    {
+        pthread_mutex_unlock( &gCompressLock );
+        return; /* drop it */
+    }
+
+    if ( gFilling->length == 0 )
+    {
+        gFilling->first = nowNs();
+    }
+    gFilling->last = (gFilling->length == 0) ? gFilling->first : nowNs();
+
+    memcpy( &gFilling->data[gFilling->length], msg, length );
+    gFilling->length += length;
+    gFilling->data[gFilling->length++] = '\n';
+
+    if ( gFilling->length >= gFrameSize )
+    {
+        /* only wait if the compressor is still busy with the previous frame */
+        while ( gReady != NULL )
+        {
+            pthread_cond_wait( &gCompressDone, &gCompressLock );
+        }
+        gReady   = gFilling;
+        gFilling = (gFilling == &gFrames[0]) ? &gFrames[1] : &gFrames[0];
+        pthread_cond_signal( &gCompressWork );
+    }
+
+    pthread_mutex_unlock( &gCompressLock );
+}
+
+unsigned int logCompressBacklog( void )
+{
+    unsigned int    backlog = 0;
+
+    pthread_mutex_lock( &gCompressLock );
+    if ( gReady != NULL && gFilling != NULL )
+    {
+        backlog = gFilling->length * 100 / gFrameSize;
+    }
+    pthread_mutex_unlock( &gCompressLock );
+
+    return backlog;
+}
+
+int logCompressOpen( const char *path, eLogCompression method, int level, unsigned int frameSize )
+{
+    static int  registered = 0;
+    char        indexPath[4096];
+    int         i, fd, result;
+
+    gMethod    = method;
+    gLevel     = level;
+    gFrameSize = frameSize;
+
+#ifndef HAVE_ZSTD
+    if ( method == kCompressZstd )
+    {
+        return ENOTSUP;
+    }
+#endif
+
+    for ( i = 0; i < 2; ++i )
+    {
+        gFrames[i].length = 0;
+        if ( reserve( (void **)&gFrames[i].data, &gFrames[i].capacity, frameSize + 1024 ) != 0 )
+        {
+            return ENOMEM;
+        }
+    }
+    gFilling  = &gFrames[0];
+    gReady    = NULL;
+    gStopping = 0;
+
+    if ( method == kCompressZlib )
+    {
+        memset( &gDeflate, 0, sizeof(gDeflate) );
+        if ( deflateInit2( &gDeflate, level, Z_DEFLATED, 15 + 16 /* gzip wrapper */, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+        {
+            return EINVAL;
+        }
+    }
+#ifdef HAVE_ZSTD
+    else
+    {
+        gZstd = ZSTD_createCCtx();
+        if ( gZstd == NULL )
+        {
+            return ENOMEM;
+        }
+        if ( level < 0 )
+        {
+            gLevel = ZSTD_CLEVEL_DEFAULT;
+        }
+    }
+#endif
+
+    gOutput = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640 );
+    snprintf( indexPath, sizeof(indexPath), "%s.idx", path );
+    fd = open( indexPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640 );
+    gIndex = (fd >= 0) ? fdopen( fd, "a" ) : NULL;
+    if ( gOutput < 0 || gIndex == NULL )
+    {
+        result = errno;
+        logCompressClose();
+        return result;
+    }
+    lockOutput( F_WRLCK );
+    fseek( gIndex, 0, SEEK_END );
+    if ( ftell( gIndex ) == 0 )
+    {
+        fprintf( gIndex, "# offset\tcompressed\tuncompressed\tfirst\tlast\n" );
+        fflush( gIndex );
+    }
+    lockOutput( F_UNLCK );
+
+    if ( !registered )
+    {
+        pthread_atfork( NULL, NULL, &compressorForked );
+        registered = 1;
+    }
+
+    result = startCompressor();
+    if ( result != 0 )
+    {
+        logCompressClose();
+    }
+    return result;
+}
+
+void logCompressClose( void )
+{
+    pthread_mutex_lock( &gCompressLock );
+    if ( !gRunning && gFilling != NULL && gFilling->length != 0 )
+    {
+        startCompressor(); /* so it can write out what's pending */
+    }
+    if ( gRunning )
+    {
+        gStopping = 1;
+        pthread_cond_signal( &gCompressWork );
+        pthread_mutex_unlock( &gCompressLock );
+
+        pthread_join( gCompressor, NULL );
+        gRunning = 0;
+    }
+    else
+    {
+        pthread_mutex_unlock( &gCompressLock );
+    }
+
+    if ( gOutput >= 0 )
+    {
+        fdatasync( gOutput );
+        close( gOutput );
+        gOutput = -1;
+    }
+    if ( gIndex != NULL )
+    {
+        fclose( gIndex );
+        gIndex = NULL;
+    }
+
+    if ( gMethod == kCompressZlib )
+    {
+        deflateEnd( &gDeflate );
+    }
+#ifdef HAVE_ZSTD
+    else if ( gZstd != NULL )
+    {
+        ZSTD_freeCCtx( gZstd );
+        gZstd = NULL;
+    }
+#endif
+
+    gFilling = NULL;
+    gMethod  = kCompressNone;
+}
+
+#include "logging-epilogue.h"
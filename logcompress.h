@@ -0,0 +1,32 @@
+#ifndef LOGCOMPRESS_H
+#define LOGCOMPRESS_H
+
+#include "logging.h"
+
+/*
+    Compressed output for the file destination. Lines are collected into
+    frames, which a background thread compresses and writes out. Each frame is
+    independently decodable (a gzip member, or a zstd frame), so the file as a
+    whole is still a valid .gz/.zst. An index alongside, <file>.idx, has a
+    line per frame: its offset & compressed size in the file, its uncompressed
+    size, and the times of its first & last lines (ns since the epoch), so
+    tools can seek straight to a time.
+*/
+
+/* the suffix for files compressed by method */
+const char *    logCompressSuffix( eLogCompression method );
+
+/* open path for compressed output, and start the compressor thread */
+int     logCompressOpen( const char *path, eLogCompression method, int level, unsigned int frameSize );
+
+/* append a line */
+void    logCompressWrite( const char *msg );
+
+/* how close writers are to waiting for the compressor, in percent: how full the
+   frame being filled is, if the compressor is still busy with the last one */
+unsigned int    logCompressBacklog( void );
+
+/* compress & write out whatever is pending, finish the index, and stop the compressor thread */
+void    logCompressClose( void );
+
+#endif //LOGCOMPRESS_H
@@ -0,0 +1,707 @@
+/*
+    Fast, printf-compatible formatting for log messages.
+
+    A format is parsed into a list of conversions, each with the literal text
+    that precedes it. Integers, hex, pointers, strings and characters have
+    their own writers; decimal output goes two digits at a time via a lookup
+    table. Literal text and strings are copied with memcpy, which glibc
+    vectorises. Floating point goes to snprintf one conversion at a time, and
+    a format using anything more exotic (%n, %m, positional arguments, ...)
+    is handed to vsnprintf whole.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "logformat.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kFlagMinus      0x01
+#define kFlagPlus       0x02
+#define kFlagSpace      0x04
+#define kFlagHash       0x08
+#define kFlagZero       0x10
+
+#define kNone           -1      /* no width or precision given */
+#define kStar           -2      /* width or precision comes from the arguments */
+
+typedef enum { kSizeInt, kSizeChar, kSizeShort, kSizeLong, kSizeLongLong, kSizeSize, kSizeMax, kSizePtrdiff } eLogSize;
+
+typedef struct {
+    const char     *literal;        /* text to copy before the conversion */
+    unsigned int    literalLength;
+    char            conversion;     /* d i u o x X c s p, f for any floating point, or 0 after the last one */
+    unsigned char   flags;
+    unsigned char   size;           /* eLogSize */
+    unsigned char   slow;           /* hand it to snprintf, via spec */
+    int             width;
+    int             precision;
+    char            spec[16];       /* "%<flags>*.*<conversion>", for the slow path */
+} tLogConversion;
+
+struct sLogFormat {
+    int             fallback;       /* not one we can handle - use vsnprintf */
+    const char     *format;
+    tLogConversion  conversion[];   /* ends with one whose conversion is 0 */
+};
+
+static const char kDigitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char kHexLower[] = "0123456789abcdef";
+static const char kHexUpper[] = "0123456789ABCDEF";
+
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+void logBufferInit( tLogBuffer *buffer )
+                            __attribute__((no_instrument_function));
+void logBufferFree( tLogBuffer *buffer )
+                            __attribute__((no_instrument_function));
+void logBufferAppend( tLogBuffer *buffer, const char *text, size_t length )
+                            __attribute__((no_instrument_function));
+void logBufferAppendUnsigned( tLogBuffer *buffer, unsigned long long value )
+                            __attribute__((no_instrument_function));
+const tLogFormat * logFormatForSite( unsigned int scope, unsigned int site, const char *format )
+                            __attribute__((no_instrument_function));
+void logFormat( tLogBuffer *buffer, const tLogFormat *parsed, const char *format, va_list vaptr )
+                            __attribute__((no_instrument_function));
+
+static int logBufferReserve( tLogBuffer *buffer, size_t more )
+                            __attribute__((no_instrument_function));
+static void logBufferPad( tLogBuffer *buffer, char with, size_t count )
+                            __attribute__((no_instrument_function));
+static char * writeDecimal( char *end, unsigned long long value )
+                            __attribute__((no_instrument_function));
+static void emitInteger( tLogBuffer *buffer, const tLogConversion *conversion, int width, int precision, unsigned long long magnitude, int negative )
+                            __attribute__((no_instrument_function));
+static void emitText( tLogBuffer *buffer, const tLogConversion *conversion, int width, const char *text, size_t length )
+                            __attribute__((no_instrument_function));
+static tLogFormat * parseFormat( const char *format )
+                            __attribute__((no_instrument_function));
+static const char * parseNumber( const char *p, int *number )
+                            __attribute__((no_instrument_function));
+static void fallbackFormat( tLogBuffer *buffer, const char *format, va_list vaptr )
+                            __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+
+void logBufferInit( tLogBuffer *buffer )
+{
+    buffer->text     = buffer->space;
+    buffer->length   = 0;
+    buffer->capacity = sizeof(buffer->space);
+    buffer->text[0]  = '\0';
+}
+
+void logBufferFree( tLogBuffer *buffer )
+{
+    if ( buffer->text != buffer->space )
+    {
+        free( buffer->text );
+    }
+    logBufferInit( buffer );
+}
+
+/* make room for another 'more' bytes, plus a terminating NUL. Returns non-zero if it can't */
+static int logBufferReserve( tLogBuffer *buffer, size_t more )
+{
+    size_t  capacity;
+    char   *grown;
+
+    if ( buffer->length + more < buffer->capacity )
+    {
+        return 0;
+    }
+
+    for ( capacity = buffer->capacity * 2; capacity <= buffer->length + more; capacity *= 2 )
+    { /* double until it fits */ }
+
+    if ( buffer->text == buffer->space )
+    {
+        grown = malloc( capacity );
+        if ( grown != NULL )
+        {
+            memcpy( grown, buffer->space, buffer->length );
+        }
+    }
+    else
+    {
+        grown = realloc( buffer->text, capacity );
+    }
+
+    if ( grown == NULL )
+    {
+        return ENOMEM;
+    }
+    buffer->text     = grown;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+void logBufferAppend( tLogBuffer *buffer, const char *text, size_t length )
+{
+    if ( logBufferReserve( buffer, length ) == 0 )
+    {
+        memcpy( &buffer->text[buffer->length], text, length );
+        buffer->length += length;
+        buffer->text[buffer->length] = '\0';
+    }
+}
+
+static void logBufferPad( tLogBuffer *buffer, char with, size_t count )
+{
+    if ( count > 0 && logBufferReserve( buffer, count ) == 0 )
+    {
+        memset( &buffer->text[buffer->length], with, count );
+        buffer->length += count;
+        buffer->text[buffer->length] = '\0';
+    }
+}
+
+/* write value backwards, ending just before end. Returns the first digit */
+static char * writeDecimal( char *end, unsigned long long value )
+{
+    unsigned int pair;
+
+    while ( value >= 100 )
+    {
+        pair   = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        *--end = kDigitPairs[pair + 1];
+        *--end = kDigitPairs[pair];
+    }
+    if ( value >= 10 )
+    {
+        pair   = (unsigned int)value * 2;
+        *--end = kDigitPairs[pair + 1];
+        *--end = kDigitPairs[pair];
+    }
+    else
+    {
+        *--end = (char)('0' + value);
+    }
+    return end;
+}
+
+void logBufferAppendUnsigned( tLogBuffer *buffer, unsigned long long value )
+{
+    char    digits[24];
+    char   *first;
+
+    first = writeDecimal( &digits[sizeof(digits)], value );
+    logBufferAppend( buffer, first, &digits[sizeof(digits)] - first );
+}
+
+/* integers of any base, with printf's sign, prefix, precision & padding rules */
+static void emitInteger( tLogBuffer *buffer, const tLogConversion *conversion, int width, int precision, unsigned long long magnitude, int negative )
+{
+    char        digits[32];
+    char       *end, *first;
+    const char *hex, *prefix;
+    size_t      count, zeros, prefixLength, total, padding;
+    int         flags;
+
+    flags  = conversion->flags;
+    end    = &digits[sizeof(digits)];
+    first  = end;
+    prefix = "";
+
+    switch ( conversion->conversion )
+    {
+    case 'x':
+    case 'X':
+        hex = (conversion->conversion == 'x') ? kHexLower : kHexUpper;
+        do {
+            *--first = hex[magnitude & 0xf];
+            magnitude >>= 4;
+        } while ( magnitude != 0 );
+
+        if ( (flags & kFlagHash) && !(first[0] == '0' && first + 1 == end) )
+        {
+            prefix = (conversion->conversion == 'x') ? "0x" : "0X";
+        }
+        break;
+
+    case 'o':
+        do {
+            *--first = (char)('0' + (magnitude & 7));
+            magnitude >>= 3;
+        } while ( magnitude != 0 );
+        break;
+
+    case 'd':
+    case 'i':
+        if ( negative )                     prefix = "-";
+        else if ( flags & kFlagPlus )       prefix = "+";
+        else if ( flags & kFlagSpace )      prefix = " ";
+        /* fall through */
+    default:
+        first = writeDecimal( end, magnitude );
+        break;
+    }
+
+    count = end - first;
+    if ( precision == 0 && count == 1 && first[0] == '0' )
+    {
+        count = 0; /* an explicit zero precision prints nothing for zero */
+        prefix = (conversion->conversion == 'x' || conversion->conversion == 'X') ? "" : prefix;
+    }
+
+    zeros = (precision > 0 && (size_t)precision > count) ? precision - count : 0;
+
+    /* '#' with 'o' makes sure the first digit is a zero */
+    if ( conversion->conversion == 'o' && (flags & kFlagHash) && zeros == 0 && (count == 0 || first[0] != '0') )
+    {
+        zeros = 1;
+    }
+
+    prefixLength = strlen( prefix );
+    total        = prefixLength + zeros + count;
+    padding      = (width > 0 && (size_t)width > total) ? width - total : 0;
+
+    if ( !(flags & kFlagMinus) )
+    {
+        if ( (flags & kFlagZero) && precision < 0 )
+        {
+            zeros  += padding;  /* zero padding goes between the sign/prefix and the digits */
+            padding = 0;
+        }
+        logBufferPad( buffer, ' ', padding );
+    }
+
+    logBufferAppend( buffer, prefix, prefixLength );
+    logBufferPad( buffer, '0', zeros );
+    logBufferAppend( buffer, first, count );
+
+    if ( flags & kFlagMinus )
+    {
+        logBufferPad( buffer, ' ', padding );
+    }
+}
+
+/* strings, characters & pointers - just padding */
+static void emitText( tLogBuffer *buffer, const tLogConversion *conversion, int width, const char *text, size_t length )
+{
+    size_t  padding;
+
+    padding = (width > 0 && (size_t)width > length) ? width - length : 0;
+
+    if ( !(conversion->flags & kFlagMinus) )
+    {
+        logBufferPad( buffer, ' ', padding );
+    }
+    logBufferAppend( buffer, text, length );
+    if ( conversion->flags & kFlagMinus )
+    {
+        logBufferPad( buffer, ' ', padding );
+    }
+}
+
+/* a width or precision, either given in the format or as a '*' */
+static const char * parseNumber( const char *p, int *number )
+{
+    if ( *p == '*' )
+    {
+        *number = kStar;
+        return p + 1;
+    }
+    if ( *p < '0' || *p > '9' )
+    {
+        *number = kNone;
+        return p;
+    }
+    for ( *number = 0; *p >= '0' && *p <= '9'; ++p )
+    {
+        if ( *number < 100000 )
+        {
+            *number = *number * 10 + (*p - '0');
+        }
+    }
+    return p;
+}
+
+static tLogFormat * parseFormat( const char *format )
+{
+    tLogFormat     *parsed;
+    tLogConversion *conversion;
+    const char     *p, *literal;
+    size_t          count;
+    int             precision;
+    char           *spec;
+
+    /* there can't be more conversions than there are '%'s */
+    for ( count = 1, p = format; (p = strchr( p, '%' )) != NULL; ++p )
+    {
+        ++count;
+    }
+
+    parsed = calloc( 1, sizeof(tLogFormat) + count * sizeof(tLogConversion) );
+    if ( parsed == NULL )
+    {
+        return NULL;
+    }
+    parsed->format = format;
+
+    conversion = parsed->conversion;
+    literal    = format;
+    p          = format;
+
+    while ( (p = strchr( p, '%' )) != NULL )
+    {
+        if ( p[1] == '%' )
+        { /* keep the first '%' as part of the literal text, and skip the second */
+            conversion->literal       = literal;
+            conversion->literalLength = p + 1 - literal;
+            conversion->conversion    = '%';
+            ++conversion;
+            literal = p += 2;
+            continue;
+        }
+
+        conversion->literal       = literal;
+        conversion->literalLength = p - literal;
+
+        for ( ++p; ; ++p )
+        {
+            if      ( *p == '-' ) conversion->flags |= kFlagMinus;
+            else if ( *p == '+' ) conversion->flags |= kFlagPlus;
+            else if ( *p == ' ' ) conversion->flags |= kFlagSpace;
+            else if ( *p == '#' ) conversion->flags |= kFlagHash;
+            else if ( *p == '0' ) conversion->flags |= kFlagZero;
+            else break;
+        }
+
+        p = parseNumber( p, &conversion->width );
+        if ( *p == '$' )
+        {
+            parsed->fallback = 1; /* positional arguments */
+            break;
+        }
+
+        conversion->precision = kNone;
+        if ( *p == '.' )
+        {
+            p = parseNumber( p + 1, &precision );
+            conversion->precision = (precision == kNone) ? 0 : precision;
+        }
+
+        switch ( *p )
+        {
+        case 'h':
+            if ( p[1] == 'h' ) { conversion->size = kSizeChar; p += 2; }
+            else               { conversion->size = kSizeShort; ++p; }
+            break;
+        case 'l':
+            if ( p[1] == 'l' ) { conversion->size = kSizeLongLong; p += 2; }
+            else               { conversion->size = kSizeLong; ++p; }
+            break;
+        case 'q': conversion->size = kSizeLongLong; ++p; break;
+        case 'z': conversion->size = kSizeSize;     ++p; break;
+        case 'j': conversion->size = kSizeMax;      ++p; break;
+        case 't': conversion->size = kSizePtrdiff;  ++p; break;
+        default:  conversion->size = kSizeInt;           break;
+        }
+
+        switch ( *p )
+        {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            conversion->conversion = *p;
+            break;
+
+        case 'c': case 's': case 'p':
+            conversion->conversion = *p;
+            /* the less common combinations are left to snprintf */
+            conversion->slow = (conversion->size != kSizeInt)
+                            || (conversion->flags & ~kFlagMinus)
+                            || (*p != 's' && conversion->precision != kNone);
+            if ( conversion->size != kSizeInt )
+            {
+                parsed->fallback = 1; /* wide characters */
+            }
+            break;
+
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            conversion->conversion = 'f';
+            conversion->slow       = 1;
+            if ( conversion->size != kSizeInt )
+            {
+                parsed->fallback = 1; /* long double */
+            }
+            break;
+
+        default:
+            parsed->fallback = 1; /* %n, %m, 'L', ... */
+            break;
+        }
+
+        if ( parsed->fallback )
+        {
+            break;
+        }
+
+        if ( conversion->slow )
+        {
+            /* '*'s for width & precision, so they can be passed whether they came from the format or not */
+            spec = conversion->spec;
+            *spec++ = '%';
+            if ( conversion->flags & kFlagMinus ) *spec++ = '-';
+            if ( conversion->flags & kFlagPlus )  *spec++ = '+';
+            if ( conversion->flags & kFlagSpace ) *spec++ = ' ';
+            if ( conversion->flags & kFlagHash )  *spec++ = '#';
+            if ( conversion->flags & kFlagZero )  *spec++ = '0';
+            memcpy( spec, "*.*", 3 );
+            spec[3] = *p;
+            spec[4] = '\0';
+        }
+
+        ++conversion;
+        literal = ++p;
+    }
+
+    /* the trailing literal text */
+    conversion->literal       = literal;
+    conversion->literalLength = strlen( literal );
+    conversion->conversion    = '\0';
+
+    return parsed;
+}
+
+const tLogFormat * logFormatForSite( unsigned int scope, unsigned int site, const char *format )
+{
+    tLogFormat  *parsed, *expected;
+
+    if ( scope >= kMaxLogScope || gLog[scope].format == NULL || site >= gLog[scope].max )
+    {
+        return NULL;
+    }
+
+    parsed = __atomic_load_n( &gLog[scope].format[site], __ATOMIC_ACQUIRE );
+    if ( parsed != NULL )
+    {
+        /* a site normally has a literal format. If it doesn't, don't try to cache it */
+        return (parsed->format == format) ? parsed : NULL;
+    }
+
+    parsed = parseFormat( format );
+    if ( parsed == NULL )
+    {
+        return NULL;
+    }
+
+    expected = NULL;
+    if ( !__atomic_compare_exchange_n( &gLog[scope].format[site], &expected, parsed, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+    {
+        /* another thread beat us to it */
+        free( parsed );
+        return (expected->format == format) ? expected : NULL;
+    }
+    return parsed;
+}
+
+/* vsnprintf, growing the buffer until it fits */
+static void fallbackFormat( tLogBuffer *buffer, const char *format, va_list vaptr )
+{
+    va_list copy;
+    int     length;
+
+    va_copy( copy, vaptr );
+    length = vsnprintf( &buffer->text[buffer->length], buffer->capacity - buffer->length, format, copy );
+    va_end( copy );
+
+    if ( length > 0 && buffer->length + length >= buffer->capacity && logBufferReserve( buffer, length ) == 0 )
+    {
+        va_copy( copy, vaptr );
+        vsnprintf( &buffer->text[buffer->length], buffer->capacity - buffer->length, format, copy );
+        va_end( copy );
+    }
+
+    if ( length > 0 )
+    {
+        buffer->length += length;
+        if ( buffer->length >= buffer->capacity )
+        {
+            buffer->length = buffer->capacity - 1; /* couldn't grow it */
+        }
+    }
+}
+
+/* the slow path for one conversion: snprintf, growing the buffer until it fits */
+#define slowFormat( buffer, conversion, width, precision, value ) \
+    do { \
+        int length_ = snprintf( &(buffer)->text[(buffer)->length], (buffer)->capacity - (buffer)->length, \
+                                (conversion)->spec, width, precision, value ); \
+        if ( length_ > 0 && (buffer)->length + length_ >= (buffer)->capacity ) \
+        { \
+            if ( logBufferReserve( buffer, length_ ) != 0 ) break; \
+            snprintf( &(buffer)->text[(buffer)->length], (buffer)->capacity - (buffer)->length, \
+                      (conversion)->spec, width, precision, value ); \
+        } \
+        if ( length_ > 0 ) (buffer)->length += length_; \
+    } while (0)
+
+void logFormat( tLogBuffer *buffer, const tLogFormat *parsed, const char *format, va_list vaptr )
+{
+    const tLogConversion   *conversion, *next;
+    tLogConversion          leftJustified;
+    const char             *str;
+    unsigned long long      magnitude;
+    long long               value;
+    size_t                  length;
+    int                     width, precision, negative;
+    char                    scratch[24];
+
+    if ( parsed == NULL || parsed->fallback )
+    {
+        fallbackFormat( buffer, format, vaptr );
+        return;
+    }
+
+    for ( next = parsed->conversion; ; ++next )
+    {
+        conversion = next;
+        logBufferAppend( buffer, conversion->literal, conversion->literalLength );
+
+        if ( conversion->conversion == '\0' )
+        {
+            break;
+        }
+        if ( conversion->conversion == '%' )
+        {
+            continue;
+        }
+
+        width     = conversion->width;
+        precision = conversion->precision;
+        if ( width == kStar )
+        {
+            width = va_arg( vaptr, int );
+        }
+        if ( precision == kStar )
+        {
+            precision = va_arg( vaptr, int );
+            if ( precision < 0 )
+            {
+                precision = kNone;
+            }
+        }
+        if ( width < 0 && width != kNone && !conversion->slow )
+        { /* a negative '*' width means left-justify (snprintf handles that itself) */
+            width = -width;
+            leftJustified        = *conversion;
+            leftJustified.flags |= kFlagMinus;
+            conversion           = &leftJustified;
+        }
+
+        if ( conversion->slow )
+        {
+            if ( width == kNone )     width = 0;
+            if ( precision == kNone ) precision = -1;
+
+            switch ( conversion->conversion )
+            {
+            case 'f':   slowFormat( buffer, conversion, width, precision, va_arg( vaptr, double ) );        break;
+            case 'p':   slowFormat( buffer, conversion, width, precision, va_arg( vaptr, void * ) );        break;
+            case 's':   slowFormat( buffer, conversion, width, precision, va_arg( vaptr, const char * ) );  break;
+            default:    slowFormat( buffer, conversion, width, precision, va_arg( vaptr, int ) );           break;
+            }
+            buffer->text[buffer->length] = '\0';
+            continue;
+        }
+
+        switch ( conversion->conversion )
+        {
+        case 'd':
+        case 'i':
+            switch ( conversion->size )
+            {
+            case kSizeChar:     value = (signed char)va_arg( vaptr, int );  break;
+            case kSizeShort:    value = (short)va_arg( vaptr, int );        break;
+            case kSizeLong:     value = va_arg( vaptr, long );              break;
+            case kSizeLongLong: value = va_arg( vaptr, long long );         break;
+            case kSizeSize:     value = va_arg( vaptr, ssize_t );           break;
+            case kSizeMax:      value = va_arg( vaptr, intmax_t );          break;
+            case kSizePtrdiff:  value = va_arg( vaptr, ptrdiff_t );         break;
+            default:            value = va_arg( vaptr, int );               break;
+            }
+            negative  = (value < 0);
+            magnitude = negative ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+            emitInteger( buffer, conversion, width, precision, magnitude, negative );
+            break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            switch ( conversion->size )
+            {
+            case kSizeChar:     magnitude = (unsigned char)va_arg( vaptr, unsigned int );   break;
+            case kSizeShort:    magnitude = (unsigned short)va_arg( vaptr, unsigned int );  break;
+            case kSizeLong:     magnitude = va_arg( vaptr, unsigned long );                 break;
+            case kSizeLongLong: magnitude = va_arg( vaptr, unsigned long long );            break;
+            case kSizeSize:     magnitude = va_arg( vaptr, size_t );                        break;
+            case kSizeMax:      magnitude = va_arg( vaptr, uintmax_t );                     break;
+            case kSizePtrdiff:  magnitude = (size_t)va_arg( vaptr, ptrdiff_t );             break;
+            default:            magnitude = va_arg( vaptr, unsigned int );                  break;
+            }
+            emitInteger( buffer, conversion, width, precision, magnitude, 0 );
+            break;
+
+        case 'c':
+            scratch[0] = (char)va_arg( vaptr, int );
+            emitText( buffer, conversion, width, scratch, 1 );
+            break;
+
+        case 's':
+            str = va_arg( vaptr, const char * );
+            if ( str == NULL )
+            {
+                /* glibc prints "(null)", unless the precision is too short for it */
+                str = (precision == kNone || precision >= 6) ? "(null)" : "";
+            }
+            length = (precision == kNone) ? strlen( str ) : strnlen( str, precision );
+            emitText( buffer, conversion, width, str, length );
+            break;
+
+        case 'p':
+            magnitude = (uintptr_t)va_arg( vaptr, void * );
+            if ( magnitude == 0 )
+            {
+                emitText( buffer, conversion, width, "(nil)", 5 );
+            }
+            else
+            {
+                str = &scratch[sizeof(scratch)];
+                do {
+                    *(char *)--str = kHexLower[magnitude & 0xf];
+                    magnitude >>= 4;
+                } while ( magnitude != 0 );
+                *(char *)--str = 'x';
+                *(char *)--str = '0';
+                emitText( buffer, conversion, width, str, &scratch[sizeof(scratch)] - str );
+            }
+            break;
+        }
+    }
+}
+
+#include "logging-epilogue.h"
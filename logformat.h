@@ -0,0 +1,38 @@
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/*
+    A printf-compatible formatter for the logging hot path. Each call site's
+    format string is parsed once, the first time it's used, and cached in the
+    site's slot. After that, formatting is just copying literal text and
+    running each argument through a writer specialised for its conversion.
+*/
+
+#define kLogBufferInline    256
+
+/* starts out on the stack, and moves to the heap if a message outgrows it */
+typedef struct {
+    char       *text;
+    size_t      length;
+    size_t      capacity;
+    char        space[kLogBufferInline];
+} tLogBuffer;
+
+typedef struct sLogFormat tLogFormat;
+
+void    logBufferInit( tLogBuffer *buffer );
+void    logBufferFree( tLogBuffer *buffer );
+void    logBufferAppend( tLogBuffer *buffer, const char *text, size_t length );
+void    logBufferAppendUnsigned( tLogBuffer *buffer, unsigned long long value );
+
+/* the parsed form of a site's format. Parsed on first use, then cached. NULL if it couldn't be */
+const tLogFormat *  logFormatForSite( unsigned int scope, unsigned int site, const char *format );
+
+/* append the formatted output to buffer. Produces the same output as vsnprintf, without truncating it.
+   If parsed is NULL, format is given to vsnprintf as-is */
+void    logFormat( tLogBuffer *buffer, const tLogFormat *parsed, const char *format, va_list vaptr );
+
+#endif //LOGFORMAT_H
@@ -7,3 +7,13 @@
 #define logDefineScopeMaximum( scope, counter)  logDSMhelper( scope, counter )
 
 logDefineScopeMaximum( LOG_SCOPE , __COUNTER__ );
+
+/*
+    marks the end of this scope's code, being the last function in the file. Function
+    tracing uses these to work out which scope a function is in (see functrace.h)
+*/
+#define logDSEhelper(scope) void logScopeEnd_##scope( void ) __attribute__((no_instrument_function)); \
+                            void logScopeEnd_##scope( void ) { }
+#define logDefineScopeEnd( scope )  logDSEhelper( scope )
+
+logDefineScopeEnd( LOG_SCOPE )
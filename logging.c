@@ -8,10 +8,17 @@
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <dlfcn.h>
 
 #include "logging.h"
+#include "logcompress.h"
+#include "logformat.h"
+#include "logring.h"
+#include "functrace.h"
 
 #ifdef UNUSED
 #elif defined(__GNUC__)
@@ -22,23 +29,55 @@
 # define UNUSED(x) x
 #endif
 
+#define kShedSampleEvery    16          /* time one write in this many, a power of two */
+#define kShedIntervalNs     (100 * 1000000ULL)  /* how often the load is looked at, and the level stepped */
+#define kShedHoldNs         (1000 * 1000000ULL) /* how long it has to stay quiet before a level comes back */
+#define kShedBacklogHigh    75          /* percent full, at which the sink is backing up */
+#define kShedBacklogLow     25          /* ... and at which it's caught up again */
+
 gLogEntry gLog[kMaxLogScope];
 
 
 /* use a function pointer to handle the logging destination */
-typedef void (*fpLogTo)(unsigned int priority, const char *msg);
-
 fpLogTo  gLogString;
 
 unsigned int    gLogDestination = kLogToUndefined;
-unsigned int    gLogLevel = 0;
+unsigned int    gLogLevel = 0;             /* only ever stored by logShedApply */
+unsigned int    gLogConfiguredLevel = 0;
 const char *    gLogName = "";
 FILE *          gLogFile;
+char *          gLogFilePath = NULL;
+struct stat     gLogFileStat;           /* to notice when the file has been rotated */
+
+eLogCompression gLogCompression = kCompressNone;
+int             gLogCompressLevel = -1;
+unsigned int    gLogFrameSize = 1024 * 1024;
+int             gLogCompressChanged = 0;
 
 void *          gDLhandle = NULL;
 int             gFunctionTraceEnabled = 0;
 int             gCallDepth = 1;
 
+unsigned long long  gShedLatency = 0;       /* ns per write at which to start shedding, 0 never to */
+unsigned long long  gWriteLatency = 0;      /* ns per write, averaged over the last few intervals */
+unsigned int        gWriteCount = 0;
+unsigned long long  gWriteTime = 0;         /* ns spent in sampled writes, since the load was last looked at */
+unsigned int        gWriteSamples = 0;      /* ... and how many there were */
+unsigned int        gShedSteps = 0;         /* how many levels below gLogConfiguredLevel we're logging at */
+unsigned long long  gShedNextCheck = 0;
+unsigned long long  gShedChanged = 0;       /* when the level was last stepped */
+int                 gShedChecking = 0;
+
+/*
+    The destination - gLogString, and the file or compressor behind it - is
+    swapped under the write side of gLogSinkLock, and written to under the read
+    side, so a reload can't close it out from under another thread. A thread
+    that logs while it already holds it (an error from part way through a swap,
+    say) carries straight on.
+*/
+static pthread_rwlock_t gLogSinkLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static __thread int     tLogSinkHeld = 0;
+
 static char *leader = "..........................................................................................";
 
 /* dynamically built by the Makefile */
@@ -50,10 +89,10 @@ static char *leader = ".........................................................
 void initLogging( const char *name )
                             __attribute__((no_instrument_function));
 
-void _log(unsigned int priority, const char *format, ...)
+void _log(unsigned int scope, unsigned int site, unsigned int line, unsigned int priority, const char *format, ...)
                             __attribute__((no_instrument_function));
 
-void _logWithLocation(const char *inFile, unsigned int atLine, unsigned int priority, const char *format, ...)
+void _logWithLocation(unsigned int scope, unsigned int site, const char *inFile, unsigned int atLine, unsigned int priority, const char *format, ...)
                             __attribute__((no_instrument_function));
 
 void _logToTheVoid( unsigned int priority, const char *msg )
@@ -64,10 +103,32 @@ void _logToFile(    unsigned int priority, const char *msg )
                             __attribute__((no_instrument_function));
 void _logToStderr(  unsigned int priority, const char *msg )
                             __attribute__((no_instrument_function));
+void _logToCompressed( unsigned int priority, const char *msg )
+                            __attribute__((no_instrument_function));
 
 void _logString(unsigned int priority, const char *format)
                             __attribute__((no_instrument_function));
 
+void logToSink( unsigned int priority, const char *msg )
+                            __attribute__((no_instrument_function));
+static void logSinkPrepareFork( void )
+                            __attribute__((no_instrument_function));
+static void logSinkAfterFork( void )
+                            __attribute__((no_instrument_function));
+static void logSinkForked( void )
+                            __attribute__((no_instrument_function));
+
+void logShedPoll( void )
+                            __attribute__((no_instrument_function));
+static void logShedApply( void )
+                            __attribute__((no_instrument_function));
+static unsigned long long logNow( void )
+                            __attribute__((no_instrument_function));
+static void logShedCheckLoad( unsigned long long now )
+                            __attribute__((no_instrument_function));
+static void logWrite( unsigned int priority, const char *msg )
+                            __attribute__((no_instrument_function));
+
 void _profileHelper(void *left, const char *middle, void *right)
                             __attribute__((no_instrument_function));
 
@@ -83,48 +144,153 @@ void __cyg_profile_func_exit(void *this_fn, void *call_site)
 /********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
 
 
+/* don't fork while another thread is part way through a write, or the child inherits the lock held */
+static void logSinkPrepareFork( void )  { pthread_rwlock_wrlock( &gLogSinkLock ); }
+static void logSinkAfterFork( void )    { pthread_rwlock_unlock( &gLogSinkLock ); }
+
+/* the child is a different thread as far as the lock's concerned, so start it afresh */
+static void logSinkForked( void )
+{
+    pthread_rwlockattr_t    attr;
+
+    pthread_rwlockattr_init( &attr );
+    pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+    pthread_rwlock_init( &gLogSinkLock, &attr );
+    pthread_rwlockattr_destroy( &attr );
+}
+
 void initLogging( const char *name )
 {
+    struct sLogFormat **formats;
+    unsigned int        count;
     int i;
 
     gLogName = name;
 
-    // initialize globals to something safe until startLogging has been invoked
-    gLogDestination = kLogToUndefined;
-    gLogLevel       = kLogDebug;
-    gLogFile        = stderr;
-    gLogString      = &_logToStderr;
+    pthread_atfork( &logSinkPrepareFork, &logSinkAfterFork, &logSinkForked );
 
-    gDLhandle       = dlopen(NULL, RTLD_LAZY);
+    // initialize globals to something safe until startLogging has been invoked
+    gLogDestination     = kLogToUndefined;
+    gLogConfiguredLevel = kLogDebug;
+    gLogFile            = stderr;
+    gLogString          = &_logToStderr;
+    logShedApply();
 
     // dynamically defined in logscopedefs.inc by Makefile
     logLogInit();
 
+    // one allocation for every scope's formats, rather than one each
+    count = 0;
+    for ( i = 0; i < kMaxLogScope; ++i )
+    {
+        count += gLog[i].max + 1;
+    }
+    formats = calloc( count, sizeof(*formats) );
+
    	for ( i = 0; i < kMaxLogScope; ++i )
    	{
-        gLog[i].level = kLogDebug;
-        if ( gLog[i].site == NULL )
+        gLog[i].level  = kLogDebug;
+        gLog[i].format = formats;
+        if ( gLog[i].site == NULL || gLog[i].format == NULL )
         {
             logCritical("### Failed to allocate memory for logging - exiting\n");
             exit(ENOMEM); // fatal
         }
+        formats += gLog[i].max + 1;
 
         logDebug("%s scope has %u log statements", logScopeNames[i], gLog[i].max);
     }
 
-    if (gDLhandle != NULL)
+    // the symbol table is only opened when a trace first needs a name (see addrToString)
+    logFunctionTraceOn();
+}
+
+void logCompression( eLogCompression method, int level, unsigned int frameSize )
+{
+    if (method != gLogCompression || level != gLogCompressLevel || frameSize != gLogFrameSize)
+    {
+        gLogCompression     = method;
+        gLogCompressLevel   = level;
+        gLogFrameSize       = frameSize;
+        gLogCompressChanged = 1;
+    }
+}
+
+/* the file we actually write to, which has a suffix if it's compressed */
+static void logFilePath( const char *logFile, char *path, size_t size )
+{
+    snprintf( path, size, "%s%s", logFile, logCompressSuffix( gLogCompression ) );
+}
+
+/* has the file we're asked to log to changed, or been rotated out from under us? */
+static int logFileChanged( const char *logFile )
+{
+    struct stat current;
+    char        path[4096];
+
+    if (logFile == NULL || gLogFilePath == NULL)
+    {
+        return (logFile != gLogFilePath);
+    }
+    if (strcmp( logFile, gLogFilePath ) != 0 || gLogCompressChanged)
     {
-        logFunctionTraceOn();
+        return 1;
     }
+
+    logFilePath( logFile, path, sizeof(path) );
+    return (stat( path, &current ) != 0
+         || current.st_ino != gLogFileStat.st_ino
+         || current.st_dev != gLogFileStat.st_dev);
+}
+
+/* tidy up the current destination. Called with gLogSinkLock held for writing */
+static void closeSink( void )
+{
+    switch (gLogDestination)
+    {
+    case kLogToSyslog:
+        closelog();
+        break;
+
+    case kLogToFile:
+        if (gLogString == &_logToCompressed)
+        {
+            /* compress & write out whatever's pending, and finish the index */
+            gLogString = &_logToStderr;
+            logCompressClose();
+        }
+        else if (gLogFile != stderr)
+        {
+            fclose( gLogFile );
+        }
+        gLogFile = stderr;
+        free( gLogFilePath );
+        gLogFilePath = NULL;
+        break;
+
+        // don't do anything for the other cases
+    default:
+        break;
+    }
+    //gLogString = &_logToTheVoid;
+    gLogDestination = kLogToUndefined; // just in case startLogging is called again
 }
 
 void startLogging( unsigned int debugLevel, eLogDestination logDest, const char * logFile )
 {
-    gLogLevel = debugLevel;
+    char    path[4096];
+    int     result;
 
-    if (logDest != gLogDestination)
+    /* if it's shedding, it carries on at the same number of levels down, until the load says otherwise */
+    __atomic_store_n( &gLogConfiguredLevel, debugLevel, __ATOMIC_RELAXED );
+    logShedApply();
+
+    if (logDest != gLogDestination || (logDest == kLogToFile && logFileChanged( logFile )))
     {
-        stopLogging();
+        pthread_rwlock_wrlock( &gLogSinkLock );
+        tLogSinkHeld = 1;
+
+        closeSink();
 
         switch (logDest)
         {
@@ -137,17 +303,38 @@ void startLogging( unsigned int debugLevel, eLogDestination logDest, const char
 
         case kLogToFile:
             gLogString = &_logToStderr;
+            gLogCompressChanged = 0;
 
             if (logFile != NULL)
             {
-                gLogFile = fopen( logFile, "a" );
+                logFilePath( logFile, path, sizeof(path) );
 
-                if (gLogFile != NULL)
+                if (gLogCompression != kCompressNone)
                 {
-                    gLogString = &_logToFile;
+                    result = logCompressOpen( path, gLogCompression, gLogCompressLevel, gLogFrameSize );
+                    if (result == 0)
+                    {
+                        gLogString = &_logToCompressed;
+                    }
+                    errno = result;
                 }
                 else
                 {
+                    gLogFile = fopen( path, "a" );
+                    if (gLogFile != NULL)
+                    {
+                        gLogString = &_logToFile;
+                    }
+                }
+
+                if (gLogString != &_logToStderr)
+                {
+                    gLogFilePath = strdup( logFile );
+                    stat( path, &gLogFileStat );
+                }
+                else
+                {
+                    gLogFile = stderr;
                     logDest = kLogToStderr;
                     logError("Unable to log to \"%s\" (%s [%d]), redirecting to stderr", logFile, strerror(errno), errno);
                 }
@@ -158,33 +345,47 @@ void startLogging( unsigned int debugLevel, eLogDestination logDest, const char
             gLogString = &_logToStderr;
             break;
 
+        case kLogToRing:
+            gLogString = &_logToRing;
+            break;
+
         default:
             gLogString = &_logToTheVoid;
             break;
         }
         gLogDestination = logDest;
+
+        tLogSinkHeld = 0;
+        pthread_rwlock_unlock( &gLogSinkLock );
     }
 }
 
 void stopLogging( void )
 {
-    switch (gLogDestination)
-    {
-    case kLogToSyslog:
-        closelog();
-        break;
+    pthread_rwlock_wrlock( &gLogSinkLock );
+    tLogSinkHeld = 1;
 
-    case kLogToFile:
-        fclose( gLogFile );
-        gLogFile = stderr;
-        break;
+    closeSink();
 
-        // don't do anything for the other cases
-    default:
-        break;
+    tLogSinkHeld = 0;
+    pthread_rwlock_unlock( &gLogSinkLock );
+}
+
+void logToSink( unsigned int priority, const char *msg )
+{
+    if (tLogSinkHeld)
+    {
+        gLogString(priority, msg);
+        return;
     }
-    //gLogString = &_logToTheVoid;
-    gLogDestination = kLogToUndefined; // just in case startLogging is called again
+
+    pthread_rwlock_rdlock( &gLogSinkLock );
+    tLogSinkHeld = 1;
+
+    gLogString(priority, msg);
+
+    tLogSinkHeld = 0;
+    pthread_rwlock_unlock( &gLogSinkLock );
 }
 
 void _logToTheVoid(unsigned int UNUSED(priority), const char * UNUSED(msg))  { /* just return */ }
@@ -195,41 +396,245 @@ void _logToFile(unsigned int UNUSED(priority), const char *msg)     { fprintf(gL
 
 void _logToStderr(unsigned int UNUSED(priority), const char *msg)   { fprintf(stderr, "%s\n", msg); }
 
+void _logToCompressed(unsigned int UNUSED(priority), const char *msg)   { logCompressWrite(msg); }
+
+
+/********** shedding **********/
 
-void _log(unsigned int priority, const char *format, ...)
+void logShedding( unsigned int latency )
 {
-    va_list vaptr;
-    char    msg[256];
+    gShedLatency = latency * 1000ULL;
+    if (gShedLatency == 0)
+    {
+        __atomic_store_n( &gShedSteps, 0, __ATOMIC_RELAXED );
+        logShedApply();
+    }
+}
 
-    va_start(vaptr, format);
+/*
+    The level in effect is the configured one, less however many steps the load
+    has taken it down. Both can change at once, so it's always worked out from
+    scratch, and the load check does it again each time it looks - a level
+    worked out from a stale value doesn't last more than one interval.
+*/
+static void logShedApply( void )
+{
+    unsigned int    configured, steps, level;
 
-    vsnprintf( msg, sizeof(msg), format, vaptr );
+    configured = __atomic_load_n( &gLogConfiguredLevel, __ATOMIC_RELAXED );
+    steps      = __atomic_load_n( &gShedSteps, __ATOMIC_RELAXED );
 
-    gLogString(priority, msg);
+    level = configured;
+    if (steps != 0 && configured > kLogError)
+    {
+        level = (configured - kLogError > steps) ? configured - steps : kLogError;
+    }
+    __atomic_store_n( &gLogLevel, level, __ATOMIC_RELAXED );
+}
 
-    va_end(vaptr);
+static unsigned long long logNow( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-void _logWithLocation(const char *inFile, unsigned int atLine, unsigned int priority, const char *format, ...)
+/*
+    Step the level down while the sink is overloaded, and back up once it's
+    stayed quiet for a while. Writes have to average under half the latency
+    that started it, and the backlog drop well below where it started, before
+    anything comes back, so it doesn't flap.
+*/
+static void logShedCheckLoad( unsigned long long now )
 {
-    va_list vaptr;
-    char    msg[256];
-    int     prefixLen, remaining;
+    unsigned long long  latency, total;
+    unsigned int        samples, backlog, ring, level, i;
+    int                 overloaded, quiet;
+    char                msg[512];
+    size_t              length;
 
-    va_start(vaptr, format);
+    if (__atomic_exchange_n( &gShedChecking, 1, __ATOMIC_ACQUIRE ) != 0)
+    {
+        return; /* another thread is on it */
+    }
+    if (now < __atomic_load_n( &gShedNextCheck, __ATOMIC_RELAXED ))
+    {
+        __atomic_store_n( &gShedChecking, 0, __ATOMIC_RELEASE );
+        return;
+    }
+    __atomic_store_n( &gShedNextCheck, now + kShedIntervalNs, __ATOMIC_RELAXED );
+
+    /*
+        Average over the whole interval, rather than line by line - most writes
+        only copy into a buffer, and it's the occasional one that has to wait
+        for the sink that tells. If nothing was written, whatever was slow has
+        had a rest.
+    */
+    samples = __atomic_exchange_n( &gWriteSamples, 0, __ATOMIC_RELAXED );
+    total   = __atomic_exchange_n( &gWriteTime, 0, __ATOMIC_RELAXED );
+    latency = (gWriteLatency + ((samples != 0) ? total / samples : 0)) / 2;
+    gWriteLatency = latency;
+
+    backlog = (gLogString == &_logToCompressed) ? logCompressBacklog() : 0;
+    ring    = logRingBacklog();
+    if (ring > backlog)
+    {
+        backlog = ring;
+    }
+
+    overloaded = (gShedLatency != 0 && (latency > gShedLatency || backlog >= kShedBacklogHigh));
+    quiet      = (latency < gShedLatency / 2 && backlog < kShedBacklogLow);
+
+    msg[0] = '\0';
+    level  = __atomic_load_n( &gLogLevel, __ATOMIC_RELAXED );
+    if (overloaded && level > kLogError)
+    {
+        if (gShedSteps == 0)
+        {
+            for ( i = 0; i < kMaxLogScope; ++i )
+            {
+                __atomic_store_n( &gLog[i].shed, 0, __ATOMIC_RELAXED );
+            }
+        }
+        __atomic_store_n( &gShedSteps, gShedSteps + 1, __ATOMIC_RELAXED );
+        gShedChanged = now;
+        snprintf( msg, sizeof(msg), "logging is overloaded (%llu us per line, %u%% backlog): only logging priority %u and above",
+                  latency / 1000, backlog, level - 1 );
+    }
+    else if (!overloaded && gShedSteps != 0 && quiet && now - gShedChanged >= kShedHoldNs)
+    {
+        __atomic_store_n( &gShedSteps, gShedSteps - 1, __ATOMIC_RELAXED );
+        if (gShedSteps != 0)
+        {
+            snprintf( msg, sizeof(msg), "logging is catching up: logging priority %u and above", level + 1 );
+        }
+        else
+        {
+            length = snprintf( msg, sizeof(msg), "logging has caught up: back to priority %u. Lines shed:",
+                               __atomic_load_n( &gLogConfiguredLevel, __ATOMIC_RELAXED ) );
+            for ( i = 0; i < kMaxLogScope && length < sizeof(msg); ++i )
+            {
+                if (gLog[i].shed != 0)
+                {
+                    length += snprintf( &msg[length], sizeof(msg) - length, " %s %lu",
+                                        logScopeNames[i], __atomic_load_n( &gLog[i].shed, __ATOMIC_RELAXED ) );
+                }
+            }
+        }
+        gShedChanged = now;
+    }
+    logShedApply();
+
+    __atomic_store_n( &gShedChecking, 0, __ATOMIC_RELEASE );
 
-    prefixLen = vsnprintf( msg, sizeof(msg), format, vaptr );
+    if (msg[0] != '\0')
+    {
+        logToSink( kLogWarning, msg ); /* whatever the level */
+    }
+}
 
-    remaining = sizeof(msg) - prefixLen - 1;
+/* write a formatted line out, timing a sample of them to see how the sink's keeping up */
+static void logWrite( unsigned int priority, const char *msg )
+{
+    unsigned long long  start, end;
 
-    if ( remaining > 10 )
+    if (gShedLatency == 0 || (__atomic_fetch_add( &gWriteCount, 1, __ATOMIC_RELAXED ) & (kShedSampleEvery - 1)) != 0)
     {
-        snprintf( &msg[prefixLen], remaining, " (%s:%d)", inFile, atLine );
+        logToSink(priority, msg);
+        return;
     }
 
-    gLogString(priority, msg);
+    start = logNow();
+    logToSink(priority, msg);
+    end   = logNow();
+
+    __atomic_add_fetch( &gWriteTime, end - start, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &gWriteSamples, 1, __ATOMIC_RELAXED );
+
+    if (end >= __atomic_load_n( &gShedNextCheck, __ATOMIC_RELAXED ))
+    {
+        logShedCheckLoad( end );
+    }
+}
+
+/*
+    A line that was filtered out while the level's been lowered. It's only
+    counted if it would have been logged at the configured level. Sites that
+    pass never get here, and the rest only call it while it's shedding.
+*/
+void _logShed( unsigned int scope, unsigned int site, unsigned int priority )
+{
+    if (priority <= __atomic_load_n( &gLogConfiguredLevel, __ATOMIC_RELAXED )
+        && gLog[scope].level >= priority && gLog[scope].max > site && gLog[scope].site[site] == 0)
+    {
+        __atomic_add_fetch( &gLog[scope].shed, 1, __ATOMIC_RELAXED );
+    }
+}
+
+void logShedPoll( void )
+{
+    unsigned long long  now;
+
+    if (gShedLatency != 0)
+    {
+        now = logNow();
+        if (now >= __atomic_load_n( &gShedNextCheck, __ATOMIC_RELAXED ))
+        {
+            logShedCheckLoad( now );
+        }
+    }
+}
+
+
+void _log(unsigned int scope, unsigned int site, unsigned int line, unsigned int priority, const char *format, ...)
+{
+    va_list     vaptr, copy;
+    tLogBuffer  msg;
+
+    logBufferInit( &msg );
+
+    va_start(vaptr, format);
+    if ( gLogFlightRecorder )
+    {
+        va_copy( copy, vaptr );
+        _vlogFlight( scope, site, priority, line, format, copy );
+        va_end( copy );
+    }
+    logFormat( &msg, logFormatForSite( scope, site, format ), format, vaptr );
+    va_end(vaptr);
+
+    logWrite(priority, msg.text);
+
+    logBufferFree( &msg );
+}
+
+void _logWithLocation(unsigned int scope, unsigned int site, const char *inFile, unsigned int atLine, unsigned int priority, const char *format, ...)
+{
+    va_list     vaptr, copy;
+    tLogBuffer  msg;
 
+    logBufferInit( &msg );
+
+    va_start(vaptr, format);
+    if ( gLogFlightRecorder )
+    {
+        va_copy( copy, vaptr );
+        _vlogFlight( scope, site, priority, atLine, format, copy );
+        va_end( copy );
+    }
+    logFormat( &msg, logFormatForSite( scope, site, format ), format, vaptr );
     va_end(vaptr);
+
+    logBufferAppend( &msg, " (", 2 );
+    logBufferAppend( &msg, inFile, strlen( inFile ) );
+    logBufferAppend( &msg, ":", 1 );
+    logBufferAppendUnsigned( &msg, atLine );
+    logBufferAppend( &msg, ")", 1 );
+
+    logWrite(priority, msg.text);
+
+    logBufferFree( &msg );
 }
 
 const char *addrToString(void *addr, char *scratch)
@@ -237,13 +642,21 @@ const char *addrToString(void *addr, char *scratch)
     const char   *str;
     Dl_info info;
 
+    if (gDLhandle == NULL)
+    {
+        gDLhandle = dlopen(NULL, RTLD_LAZY);
+    }
+
     str = NULL;
-    if (gDLhandle != NULL )
+    if (gDLhandle != NULL && dladdr(addr, &info) != 0)
     {
-        dladdr(addr, &info);
         str = info.dli_sname;
     }
     if (str == NULL)
+    {
+        str = functionTraceName(addr); /* static functions aren't dynamic symbols */
+    }
+    if (str == NULL)
     {
         sprintf( scratch, "0x%08lx", (unsigned long)addr);
         str = scratch;
@@ -257,27 +670,38 @@ const char *addrToString(void *addr, char *scratch)
 
     If just left on, this generates so much logging that it's rarely useful.
     Please use logFunctionTraceOn and logFunctionTraceOff around the
-    code/situation you care about.
+    code/situation you care about, and/or a filter to pick out the functions
+    you care about (see functrace.h).
 */
 
 void _profileHelper(void *left, const char *middle, void *right)
 {
     // some scratch space, in case addrToString needs it. avoids needless malloc churn
-    char leftScratch[16];
-    char rightScratch[16];
+    char leftScratch[24];
+    char rightScratch[24];
     char msg[256];
 
     if (gFunctionTraceEnabled && gLogDestination != kLogToUndefined)
     {
         snprintf(msg, sizeof(msg), "%.*s %s() %s %s()", gCallDepth, leader, addrToString(left, leftScratch), middle, addrToString(right, rightScratch));
-        gLogString(kLogDebug, msg);
+        logToSink(kLogDebug, msg);
     }
 }
 
 /* just landed in a function */
 void __cyg_profile_func_enter(void *this_fn, void *call_site)
 {
-    _profileHelper( call_site, "called", this_fn );
+    if (functionTraced( this_fn ))
+    {
+        if (gFunctionTraceCounting != kTraceCountOnly)
+        {
+            _profileHelper( call_site, "called", this_fn );
+        }
+        if (gFunctionTraceCounting != kTraceCountOff)
+        {
+            _functionTraceEnter( this_fn );
+        }
+    }
     ++gCallDepth;
 }
 
@@ -286,7 +710,18 @@ void __cyg_profile_func_exit(void *this_fn, void *call_site)
 {
     --gCallDepth;
     if (gCallDepth < 1) gCallDepth = 1;
-    _profileHelper( this_fn, "returned to", call_site );
+
+    if (functionTraced( this_fn ))
+    {
+        if (gFunctionTraceCounting != kTraceCountOff)
+        {
+            _functionTraceExit( this_fn );
+        }
+        if (gFunctionTraceCounting != kTraceCountOnly)
+        {
+            _profileHelper( this_fn, "returned to", call_site );
+        }
+    }
 }
 
 
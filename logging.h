@@ -6,21 +6,31 @@
 #define LOGGING_H
 
 #include    <syslog.h>
+#include    <stdarg.h>
 
 /* this is dynamically built by the Makefile */
 #include "obj/logscopes.inc"
 
-extern unsigned int     gLogLevel;
+extern unsigned int     gLogLevel;              /* the level in effect - lower than configured while shedding */
+extern unsigned int     gLogConfiguredLevel;    /* the level asked for, whether or not it's being shed */
 extern int              gFunctionTraceEnabled;
+extern int              gLogFlightRecorder;     /* non-zero when the flight recorder is running */
 
 typedef struct {
-    unsigned int    level;
-    unsigned int    max;
-    unsigned char  *site;
+    unsigned int        level;
+    unsigned int        max;
+    unsigned char      *site;
+    struct sLogFormat **format;     /* each site's parsed format, once it's been used (see logformat.h) */
+    unsigned long       shed;       /* lines that would have been logged, if they weren't being shed */
 } gLogEntry;
 
 extern gLogEntry gLog[kMaxLogScope];
 
+extern const char * logScopeNames[];
+
+/* the last function in each scope, in the same order as logScopeNames (see logging-epilogue.h) */
+extern void (* const logScopeEnds[])( void );
+
 #define kLogEmergency   LOG_EMERG
 #define kLogAlert       LOG_ALERT
 #define kLogCritical    LOG_CRIT
@@ -30,7 +40,9 @@ extern gLogEntry gLog[kMaxLogScope];
 #define kLogInfo        LOG_INFO
 #define kLogDebug       LOG_DEBUG
 
-typedef enum { kLogToUndefined, kLogToSyslog, kLogToFile, kLogToStderr } eLogDestination;
+typedef enum { kLogToUndefined, kLogToSyslog, kLogToFile, kLogToStderr, kLogToRing } eLogDestination;
+
+typedef enum { kCompressNone, kCompressZlib, kCompressZstd } eLogCompression;
 
 /* set up the logging mechanisms. Call once, very early. */
 void    initLogging( const char *name );
@@ -41,17 +53,48 @@ void    startLogging( unsigned int debugLevel, eLogDestination logDest, const ch
 /* tidy up the current logging mechanism */
 void    stopLogging( void );
 
+/* compress file logging. Takes effect the next time startLogging opens the file. level -1 is the default */
+void    logCompression( eLogCompression method, int level, unsigned int frameSize );
+
+/*
+    shed lower priority logging while writing it takes more than latency us per
+    line on average, or the sink is backing up, rather than make an overload
+    worse. Errors and above are always logged. 0 never sheds
+*/
+void    logShedding( unsigned int latency );
+
+/* look at the load, if it's due. Call every so often, so a level that's been shed comes back even when nothing's being written */
+void    logShedPoll( void );
+
+/* look up the symbol name for an address. scratch must have room for a hex address, if there isn't one */
+const char *addrToString(void *addr, char *scratch) __attribute__((no_instrument_function));
+
 /* start logging function entry & exit */
 static inline void logFunctionTraceOn() { gFunctionTraceEnabled = 1; };
 
 /* stop logging function entry & exit */
 static inline void logFunctionTraceOff() { gFunctionTraceEnabled = 0; };
 
+/* the current logging destination. Private - write to it with logToSink */
+typedef void (*fpLogTo)(unsigned int priority, const char *msg);
+extern fpLogTo  gLogString;
+
+/* write a formatted line to the current destination, which can't be swapped while it's being written */
+void    logToSink( unsigned int priority, const char *msg ) __attribute__((no_instrument_function));
+
+/* writes to this process's shared memory log ring (see logring.h) */
+void    _logToRing( unsigned int priority, const char *msg ) __attribute__((no_instrument_function));
+
 /* private helpers, used by preprocessor macros. Please don't use directly! */
-void    _log( unsigned int priority, const char *format, ...)
-            __attribute__((__format__ (__printf__, 2, 3))) __attribute__((no_instrument_function));
-void    _logWithLocation( const char *inFile, unsigned int atLine, unsigned int priority, const char *format, ...)
-            __attribute__((__format__ (__printf__, 4, 5))) __attribute__((no_instrument_function));
+void    _log( unsigned int scope, unsigned int site, unsigned int line, unsigned int priority, const char *format, ...)
+            __attribute__((__format__ (__printf__, 5, 6))) __attribute__((no_instrument_function));
+void    _logWithLocation( unsigned int scope, unsigned int site, const char *inFile, unsigned int atLine, unsigned int priority, const char *format, ...)
+            __attribute__((__format__ (__printf__, 6, 7))) __attribute__((no_instrument_function));
+void    _logFlight( unsigned int scope, unsigned int site, unsigned int priority, unsigned int line, const char *format, ...)
+            __attribute__((__format__ (__printf__, 5, 6))) __attribute__((no_instrument_function));
+void    _vlogFlight( unsigned int scope, unsigned int site, unsigned int priority, unsigned int line, const char *format, va_list vaptr )
+            __attribute__((no_instrument_function));
+void    _logShed( unsigned int scope, unsigned int site, unsigned int priority ) __attribute__((no_instrument_function));
 
 #define logEmergency(...)   logWithLocation(kLogEmergency,  __VA_ARGS__ )
 #define logAlert(...)       logWithLocation(kLogAlert,      __VA_ARGS__ )
@@ -61,19 +104,44 @@ void    _logWithLocation( const char *inFile, unsigned int atLine, unsigned int
 #define logNotice(...)      log(kLogNotice,     __VA_ARGS__ )
 #define logInfo(...)        log(kLogInfo,       __VA_ARGS__ )
 
-#ifndef RELEASE_BUILD
-# define logDebug(...)      logWithLocation(kLogDebug,      __VA_ARGS__ )
-# define logCheckpoint()    do { _log( __FILE__, __LINE__, kLogDebug, "reached" ); } while (0)
-#else
-# define logDebug(...)      do {} while (0)
-# define logCheckpoint()    do {} while (0)
+#define logDebug(...)       logWithLocation(kLogDebug,      __VA_ARGS__ )
+#define logCheckpoint()     logWithLocation( kLogDebug, "reached" )
+
+/*
+    sites less important than LOG_MIN_LEVEL compile to nothing - not even the
+    flight recorder sees them. Release builds set it per scope (see the Makefile)
+*/
+#ifndef LOG_MIN_LEVEL
+# define LOG_MIN_LEVEL      kLogDebug
 #endif
+#define logCompiledIn(priority)             ( (priority) <= LOG_MIN_LEVEL )
+
+/* most sites are filtered out most of the time, so keep the call out of line */
+#define logUnlikely(x)                      __builtin_expect( !!(x), 0 )
 
 #define logCheck_expand_again(priority, scope, id)  ( gLogLevel >= priority && gLog[kLog_##scope].max > id && gLog[kLog_##scope].level >= priority && gLog[kLog_##scope].site[id] == 0 )
 #define logCheck(priority, scope, id)       logCheck_expand_again(priority, scope, id)
 
-#define log(priority, ...)              do { if (  logCheck( priority, LOG_SCOPE, __COUNTER__ ) ) _log( priority, __VA_ARGS__ ); } while (0)
-#define logWithLocation(priority, ...)  do { if (  logCheck( priority, LOG_SCOPE, __COUNTER__ ) ) _logWithLocation( __FILE__, __LINE__, priority, __VA_ARGS__ ); } while (0)
+/*
+    every site feeds the flight recorder when it's running, whatever the current log level.
+    Lines that are logged are recorded by _log, so the arguments are only evaluated once
+*/
+#define logFlight(priority, scope, id, ...) do { if ( gLogFlightRecorder ) _logFlight( kLog_##scope, id, priority, __LINE__, __VA_ARGS__ ); } while (0)
+
+/* a site that's filtered out only looks at whether it was shed while the level's actually down */
+#define logShed(priority, scope, id)        do { if ( logUnlikely( gLogLevel < gLogConfiguredLevel ) ) _logShed( kLog_##scope, id, priority ); } while (0)
+
+#define log_expand_again(priority, scope, id, ...)              do { if ( logCompiledIn( priority ) ) { \
+                                                                     if ( logUnlikely( logCheck_expand_again( priority, scope, id ) ) ) _log( kLog_##scope, id, __LINE__, priority, __VA_ARGS__ ); \
+                                                                     else { logFlight( priority, scope, id, __VA_ARGS__ ); logShed( priority, scope, id ); } } } while (0)
+#define logWithLocation_expand_again(priority, scope, id, ...)  do { if ( logCompiledIn( priority ) ) { \
+                                                                     if ( logUnlikely( logCheck_expand_again( priority, scope, id ) ) ) _logWithLocation( kLog_##scope, id, __FILE__, __LINE__, priority, __VA_ARGS__ ); \
+                                                                     else { logFlight( priority, scope, id, __VA_ARGS__ ); logShed( priority, scope, id ); } } } while (0)
+#define log_expand(priority, scope, id, ...)                    log_expand_again( priority, scope, id, __VA_ARGS__ )
+#define logWithLocation_expand(priority, scope, id, ...)        logWithLocation_expand_again( priority, scope, id, __VA_ARGS__ )
+
+#define log(priority, ...)              log_expand( priority, LOG_SCOPE, __COUNTER__, __VA_ARGS__ )
+#define logWithLocation(priority, ...)  logWithLocation_expand( priority, LOG_SCOPE, __COUNTER__, __VA_ARGS__ )
 
 #endif
 
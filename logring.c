@@ -0,0 +1,411 @@
+/*
+    Cross-process log aggregation via shared memory rings.
+
+    Each ring has a single producing process and a single consumer (the
+    master's collector thread). Threads within the producing process reserve
+    a record with a CAS on the ring's head, fill it in, then commit it by
+    publishing its sequence number. The collector only reads committed
+    records, so if a worker dies part way through writing one, everything
+    committed before it can still be recovered.
+
+    A line too long for one record is chained over consecutive ones, all
+    reserved by the same CAS. Past kLogMaxChain records, it's truncated, and
+    marked as such.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "logring.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kLogRecordSize      512     /* bytes per record, including the header */
+#define kLogRecordText      (kLogRecordSize - 40)   /* bytes of the line each record carries */
+#define kLogRingRecords     256     /* records per ring, a power of two */
+#define kLogMaxChain        16      /* records a long line may be chained over */
+#define kLogTruncated       " [truncated]"
+#define kCollectIntervalUs  20000   /* how often the collector looks for new records */
+
+typedef struct {
+    atomic_ulong        seq;            /* index + 1 once committed, so the collector can tell */
+    unsigned long long  timestamp;      /* CLOCK_REALTIME, in ns */
+    unsigned short      priority;
+    unsigned char       part;           /* 0 for a line's first record, then 1, 2... for the rest of it */
+    unsigned char       more;           /* in the first record, how many more the line continues into */
+    pid_t               pid;
+    char                process[16];    /* gProcessName of the writer */
+    char                msg[kLogRecordText];    /* only the line's last record is NUL terminated */
+} tLogRecord;
+
+typedef struct {
+    atomic_int          owner;          /* pid of the producer, 0 if free, -pid once it has exited */
+    atomic_ulong        head;           /* next record to be reserved by the producer */
+    atomic_ulong        tail;           /* next record to be read by the collector */
+    atomic_ulong        dropped;        /* records lost because the ring was full */
+    tLogRecord          record[kLogRingRecords];
+} tLogRing;
+
+static tLogRing *       gLogRings = NULL;
+static unsigned int     gLogRingCount = 0;
+static tLogRing *       gLogRing = NULL;    /* the ring this process writes to, if any */
+
+static pthread_t        gCollector;
+static atomic_int       gCollecting = 0;
+static pthread_mutex_t  gCollectLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+void _logToRing( unsigned int priority, const char *msg )
+                            __attribute__((no_instrument_function));
+
+unsigned int logRingBacklog( void )
+                            __attribute__((no_instrument_function));
+
+static tLogRecord * ringOldest( tLogRing *ring, int owner )
+                            __attribute__((no_instrument_function));
+
+static int chainCommitted( tLogRing *ring, unsigned long first, unsigned int more )
+                            __attribute__((no_instrument_function));
+
+static unsigned int collectRings( int finalize )
+                            __attribute__((no_instrument_function));
+
+static void * collectorThread( void *arg )
+                            __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE INSTRUMENTATION! **********/
+
+
+int logRingInit( unsigned int count )
+{
+    gLogRings = mmap( NULL, count * sizeof(tLogRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( gLogRings == MAP_FAILED )
+    {
+        gLogRings = NULL;
+        logError( "unable to map the log rings (%s [%d])", strerror(errno), errno );
+        return errno;
+    }
+    /* anonymous mappings start zeroed, so every ring is already free & empty */
+    gLogRingCount = count;
+
+    return 0;
+}
+
+int logRingAttach( void )
+{
+    unsigned int i;
+    int          unowned;
+
+    for ( i = 0; i < gLogRingCount; ++i )
+    {
+        unowned = 0;
+        if ( atomic_compare_exchange_strong( &gLogRings[i].owner, &unowned, getpid() ) )
+        {
+            gLogRing = &gLogRings[i];
+            startLogging( gLogConfiguredLevel, kLogToRing, NULL );
+            return 0;
+        }
+    }
+
+    logError( "all %u log rings are in use, logging directly", gLogRingCount );
+    return EBUSY;
+}
+
+int logRingAttached( void )
+{
+    return (gLogRing != NULL);
+}
+
+unsigned int logRingBacklog( void )
+{
+    tLogRing       *ring = gLogRing;
+
+    if ( ring == NULL )
+    {
+        return 0;
+    }
+    return (atomic_load( &ring->head ) - atomic_load( &ring->tail )) * 100 / kLogRingRecords;
+}
+
+void _logToRing( unsigned int priority, const char *msg )
+{
+    tLogRing       *ring = gLogRing;
+    tLogRecord     *record;
+    struct timespec now;
+    unsigned long   pos;
+    size_t          length, chunk;
+    unsigned int    count, i;
+    int             truncated;
+
+    /* the last record needs room for the NUL */
+    length    = strlen( msg );
+    count     = length / kLogRecordText + 1;
+    truncated = (count > kLogMaxChain);
+    if ( truncated )
+    {
+        count  = kLogMaxChain;
+        length = kLogMaxChain * kLogRecordText - sizeof(kLogTruncated);
+    }
+
+    pos = atomic_load( &ring->head );
+    do {
+        if ( pos + count - atomic_load( &ring->tail ) > kLogRingRecords )
+        { /* full - never block the worker waiting for the collector */
+            atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+            return;
+        }
+    } while ( !atomic_compare_exchange_weak( &ring->head, &pos, pos + count ) );
+
+    record = &ring->record[pos % kLogRingRecords];
+
+    clock_gettime( CLOCK_REALTIME, &now );
+    record->timestamp = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->priority  = priority;
+    record->more      = count - 1;
+    record->pid       = getpid();
+    strncpy( record->process, gProcessName, sizeof(record->process) - 1 );
+    record->process[sizeof(record->process) - 1] = '\0';
+
+    for ( i = 0; i < count; ++i, msg += chunk, length -= chunk )
+    {
+        record = &ring->record[(pos + i) % kLogRingRecords];
+        record->part = i;
+
+        chunk = (length < kLogRecordText) ? length : kLogRecordText;
+        memcpy( record->msg, msg, chunk );
+        if ( i == count - 1 )
+        {
+            if ( truncated )
+            {
+                memcpy( &record->msg[chunk], kLogTruncated, sizeof(kLogTruncated) );
+            }
+            else
+            {
+                record->msg[chunk] = '\0';
+            }
+        }
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        atomic_store_explicit( &ring->record[(pos + i) % kLogRingRecords].seq, pos + i + 1, memory_order_release );
+    }
+}
+
+/* have all the records a line continues into been committed? */
+static int chainCommitted( tLogRing *ring, unsigned long first, unsigned int more )
+{
+    unsigned long   i;
+
+    for ( i = first + 1; i <= first + more; ++i )
+    {
+        if ( atomic_load_explicit( &ring->record[i % kLogRingRecords].seq, memory_order_acquire ) != i + 1 )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Find the oldest committed record at the tail of a ring, or NULL.
+    In a ring whose producer has exited, skip over records that were reserved
+    but never committed - they never will be now - along with the rest of any
+    line whose first record is one of them.
+*/
+static tLogRecord * ringOldest( tLogRing *ring, int owner )
+{
+    tLogRecord     *record;
+    unsigned long   tail;
+
+    for ( tail = atomic_load( &ring->tail ); tail != atomic_load( &ring->head ); atomic_store( &ring->tail, ++tail ) )
+    {
+        record = &ring->record[tail % kLogRingRecords];
+        if ( atomic_load_explicit( &record->seq, memory_order_acquire ) == tail + 1 && record->part == 0 )
+        {
+            if ( owner <= 0 || chainCommitted( ring, tail, record->more ) )
+            {
+                return record;
+            }
+            return NULL; /* the rest of it is still being written */
+        }
+        if ( owner > 0 )
+        {
+            break; /* still being written */
+        }
+    }
+    return NULL;
+}
+
+/* merge everything committed so far, oldest first, and hand it to the real destination */
+static unsigned int collectRings( int finalize )
+{
+    tLogRing       *ring, *oldestRing;
+    tLogRecord     *record, *oldest;
+    char            line[kLogMaxChain * kLogRecordText + 64];
+    unsigned long   dropped, tail;
+    unsigned int    i, count, part;
+    size_t          length;
+    int             owner;
+
+    pthread_mutex_lock( &gCollectLock );
+
+    count = 0;
+    do {
+        oldest     = NULL;
+        oldestRing = NULL;
+        for ( i = 0; i < gLogRingCount; ++i )
+        {
+            ring  = &gLogRings[i];
+            owner = atomic_load( &ring->owner );
+            if ( owner == 0 )
+            {
+                continue;
+            }
+            record = ringOldest( ring, finalize ? -1 : owner );
+            if ( record != NULL && (oldest == NULL || record->timestamp < oldest->timestamp) )
+            {
+                oldest     = record;
+                oldestRing = ring;
+            }
+        }
+
+        if ( oldest != NULL )
+        {
+            length = snprintf( line, sizeof(line), "%s[%d]: ", oldest->process, oldest->pid );
+
+            /* put a chained line back together. Only an exited worker can have left gaps in one */
+            tail = atomic_load( &oldestRing->tail );
+            for ( part = 0; part <= oldest->more; ++part )
+            {
+                record = &oldestRing->record[(tail + part) % kLogRingRecords];
+                if ( atomic_load_explicit( &record->seq, memory_order_acquire ) != tail + part + 1 )
+                {
+                    length += snprintf( &line[length], sizeof(line) - length, "%s", kLogTruncated );
+                    break;
+                }
+                length += strnlen( memcpy( &line[length], record->msg, kLogRecordText ), kLogRecordText );
+            }
+            line[length] = '\0';
+
+            logToSink( oldest->priority, line );
+
+            atomic_fetch_add( &oldestRing->tail, 1 + oldest->more );
+            ++count;
+        }
+    } while ( oldest != NULL );
+
+    for ( i = 0; i < gLogRingCount; ++i )
+    {
+        ring  = &gLogRings[i];
+        owner = atomic_load( &ring->owner );
+
+        dropped = atomic_exchange( &ring->dropped, 0 );
+        if ( dropped != 0 )
+        {
+            snprintf( line, sizeof(line), "%lu log records from process %d were dropped (ring full)", dropped, owner < 0 ? -owner : owner );
+            logToSink( kLogWarning, line );
+        }
+
+        /* everything an exited worker managed to commit has been written, so free its ring */
+        if ( owner < 0 )
+        {
+            atomic_store( &ring->head, 0 );
+            atomic_store( &ring->tail, 0 );
+            memset( ring->record, 0, sizeof(ring->record) );
+            atomic_store( &ring->owner, 0 );
+        }
+    }
+
+    pthread_mutex_unlock( &gCollectLock );
+
+    return count;
+}
+
+void logRingRelease( pid_t pid )
+{
+    unsigned int i;
+    int          owner;
+
+    for ( i = 0; i < gLogRingCount; ++i )
+    {
+        owner = pid;
+        if ( atomic_compare_exchange_strong( &gLogRings[i].owner, &owner, -pid ) )
+        {
+            collectRings( 0 );
+        }
+    }
+}
+
+static void * collectorThread( void * UNUSED(arg) )
+{
+    while ( atomic_load( &gCollecting ) )
+    {
+        collectRings( 0 );
+        usleep( kCollectIntervalUs );
+    }
+    return NULL;
+}
+
+/* don't fork while the collector is part way through writing, or the child inherits its locks */
+static void collectorPrepareFork( void )    { pthread_mutex_lock( &gCollectLock ); }
+static void collectorAfterFork( void )      { pthread_mutex_unlock( &gCollectLock ); }
+
+int logRingStartCollector( void )
+{
+    sigset_t    all, previous;
+    int         result;
+
+    pthread_atfork( &collectorPrepareFork, &collectorAfterFork, &collectorAfterFork );
+
+    atomic_store( &gCollecting, 1 );
+
+    /* leave the master's signals to the master */
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &previous );
+    result = pthread_create( &gCollector, NULL, &collectorThread, NULL );
+    pthread_sigmask( SIG_SETMASK, &previous, NULL );
+
+    if ( result != 0 )
+    {
+        atomic_store( &gCollecting, 0 );
+        logError( "unable to start the log collector thread (%s [%d])", strerror(result), result );
+    }
+    return result;
+}
+
+void logRingStopCollector( void )
+{
+    if ( atomic_exchange( &gCollecting, 0 ) )
+    {
+        pthread_join( gCollector, NULL );
+    }
+    if ( gLogRings != NULL )
+    {
+        collectRings( 1 );
+    }
+}
+
+#include "logging-epilogue.h"
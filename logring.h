@@ -0,0 +1,31 @@
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <sys/types.h>
+
+/*
+    Cross-process log aggregation. Each forked worker writes its log records
+    into its own ring in a shared mapping, and a collector thread in the master
+    merges them by timestamp and does all the actual writing.
+*/
+
+/* map the shared rings. Call in the master, before forking any workers */
+int     logRingInit( unsigned int count );
+
+/* in a freshly forked worker: claim a ring, and send this process's logging to it */
+int     logRingAttach( void );
+
+/* non-zero if this process is logging to a ring */
+int     logRingAttached( void );
+
+/* how full this process's ring is, in percent. 0 if it isn't logging to one */
+unsigned int    logRingBacklog( void );
+
+/* in the master: start/stop the thread that collects from the rings */
+int     logRingStartCollector( void );
+void    logRingStopCollector( void );
+
+/* in the master: a worker has exited. Recover what's left in its ring, then free it */
+void    logRingRelease( pid_t pid );
+
+#endif //LOGRING_H
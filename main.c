@@ -16,10 +16,18 @@
 #include <string.h>     /* basic string functions */
 #include <sys/stat.h>   /* inode manipulation (needed for umask()) */
 #include <sys/wait.h>   /* for waitpid() and friends on linux */
+#include <sys/epoll.h>  /* for waiting on configuration changes */
+#include <sys/prctl.h>  /* PR_SET_PDEATHSIG */
 
 #include "common.h"     /* common stuff */
 #include "config.h"     /* config file & command line configuration parsing */
 #include "background.h"
+#include "watchdog.h"   /* event loop stall watchdog */
+#include "logring.h"    /* shared memory log aggregation */
+#include "flightrecorder.h" /* crash-proof recording of all logging */
+#include "sdnotify.h"   /* systemd readiness, watchdog & socket activation */
+#include "startup.h"    /* startup phase timing */
+#include "functrace.h"  /* selective function tracing */
 
 #include "logging.h"    /* our logging support */
 
@@ -39,12 +47,22 @@
 const char *    gExecName;      /* base name of the execuatable, derived from argv[0]. Same for all processes */
 const char *    gProcessName;   /* Name of this process/instance - different in each process */
 
+static volatile sig_atomic_t    gChildExited = 0;   /* set by restartChildren */
+static volatile sig_atomic_t    gTerminating = 0;   /* set by terminateChildren */
+static pid_t                    gWorker = 0;        /* the supervised worker, if any */
+static int                      gConfigWatch = -1;  /* the master's watch on its configuration */
+
+#define kLogRings   4   /* log rings to map when aggregating - allows for workers being respawned */
+
 /*
  * FUNCTIONS
  */
 
 int     trapSignals(bool on);
-int     daemonize(bool inForeground);
+int     daemonize(const kConfigurationOptions *options);
+int     supervise(void);
+pid_t   spawnWorker(bool aggregate);
+bool    aggregateWorkers(bool aggregating);
 
 /*
  * Main entry point.
@@ -53,9 +71,8 @@ int     daemonize(bool inForeground);
  */
 int main(int argc, const char *argv[])
 {
-    int                   status;
-    eLogDestination       logTo;
-    kConfigurationOptions *options;
+    int                         status;
+    const kConfigurationOptions *options;
 
     /* extract the executable name */
     gExecName = strrchr(argv[0], '/');
@@ -73,29 +90,42 @@ int main(int argc, const char *argv[])
     initLogging( gExecName );
     // enable pre-config logging with some sensible defaults
     startLogging( kLogDebug, kLogToStderr, NULL );
+    startupPhase( "logging" );
 
     options = parseConfiguration( argc, argv );
 
-    if (options->logFile != NULL)
-    {
-        logTo = kLogToFile;
-    }
-    else if (options->foreground)
+    // re-enable logging with user-supplied configuration
+    configureLogging( options );
+    startupPhase( "configuration" );
+
+    if (options->flightDump != NULL)
     {
-        logTo = kLogToStderr;
+        status = flightRecorderDump( options->flightDump, stdout );
+        stopLogging();
+        return status;
     }
-    else
+
+    if (options->flightRecorder != NULL)
     {
-        logTo = kLogToSyslog;
+        flightRecorderStart( options->flightRecorder );
+        startupPhase( "flight recorder" );
     }
 
-    // re-enable logging with user-supplied configuration
-    startLogging( options->debugLevel, logTo, options->logFile );
-
     logInfo("%s started", gExecName);
 
-    status = daemonize(options->foreground);
+    // systemd's variables are for this process, so pick them up before we fork
+    sdNotifyInit();
+    sdListenFds();
+
+    // the heartbeat must be shared with any workers, so map it before we fork
+    watchdogInit();
+    startupPhase( "watchdog" );
+
+    status = daemonize(options);
+
+    sdNotifyStopping();
 
+    functionTraceLogStats();
     stopLogging();
 
     return status;
@@ -108,11 +138,11 @@ int main(int argc, const char *argv[])
     If running in the foreground, this is skipped, and background() is
     called directly.
 */
-int daemonize(bool inForeground)
+int daemonize(const kConfigurationOptions *options)
 {
     pid_t   pid;
 
-    if (!inForeground)
+    if (!options->foreground)
     {
         /*
          * Fork is a strange and unique system call. Along with exec(), it forms one of
@@ -128,7 +158,10 @@ int daemonize(bool inForeground)
          * Because the child process will see fork() returning 0, and the parent will
          * see fork() returning a pid, we can carefully diverge the behavior of both to
          * do what we want!
+         *
+         * Flush first, or anything still buffered will be written by both processes.
          */
+        fflush(NULL);
         pid = fork();
 
         if (pid < 0)
@@ -141,9 +174,11 @@ int daemonize(bool inForeground)
         {
             /* fork successful! Tell us the forked processes's pid and exit */
             logInfo("daemon process: %d\n", pid);
+            sdNotifyMainPid(pid);
             return 0;
         }
         /* Forked process continues here */
+        sdNotifyMainPid(getpid());
 
         /* Give our forked process a different name */
         gProcessName = "background";
@@ -194,12 +229,228 @@ int daemonize(bool inForeground)
             logError("unable to trap signals\n");
             return -1;
         }
+        startupPhase( "daemonize" );
+
+        if (options->supervise)
+        {
+            return supervise(); /* the actual work happens in a worker process */
+        }
+    }
+    else if (!trapSignals(true))
+    {
+        /* in the foreground too, so TERM & INT stop us cleanly rather than kill us */
+        logError("unable to trap signals");
+        return -1;
     }
 
     return background(); /* all set up, so go do some actual work */
 }
 
 
+/*
+    Fork a worker process to run background(). Returns its pid in the master,
+    or -1 if the fork failed. Never returns in the worker.
+ */
+pid_t spawnWorker(bool aggregate)
+{
+    static unsigned int spawned = 0;
+    pid_t   pid, master;
+    int     status;
+
+    /* give the new worker a fresh heartbeat to start from */
+    watchdogHeartbeat();
+
+    master = getpid();
+
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0)
+    {
+        logError("fork failed (%s [%d])", strerror(errno), errno);
+    }
+    else if (pid == 0)
+    {
+        /* Worker continues here - the master looks after its children, but TERM & INT still stop us cleanly */
+        gProcessName = "worker";
+        signal(SIGCHLD, SIG_DFL);
+
+        /* the worker watches the configuration for itself, once its loop is running */
+        configUnwatch(gConfigWatch);
+
+        /* without the master, nothing would restart or watch us, so go when it does */
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != master)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        /* the first worker finishes the daemon's startup, a respawned one times its own */
+        if (spawned > 0)
+        {
+            startupRestart();
+        }
+
+        if (aggregate)
+        {
+            logRingAttach();
+        }
+        startupPhase( "worker" );
+
+        status = background();
+
+        functionTraceLogStats();
+        stopLogging();
+        exit(status);
+    }
+    else
+    {
+        logInfo("worker process: %d", pid);
+        ++spawned;
+    }
+    return pid;
+}
+
+/*
+    Whether workers started from now on should log via shared memory, with us
+    doing the writing, as the current configuration asks. The rings and the
+    collector are only set up the first time it's asked for, and kept after.
+ */
+bool aggregateWorkers(bool aggregating)
+{
+    const kConfigurationOptions *options;
+    static bool         collecting = false;
+    bool                aggregate;
+
+    options   = configAcquire();
+    aggregate = options->aggregate;
+    configRelease();
+
+    if (aggregate && !collecting)
+    {
+        if (logRingInit(kLogRings) != 0 || logRingStartCollector() != 0)
+        {
+            return false;
+        }
+        collecting = true;
+    }
+    if (aggregate != aggregating)
+    {
+        logInfo("workers will %slog via the master", aggregate ? "" : "no longer ");
+    }
+    return aggregate;
+}
+
+/*
+    The master's loop, when supervising. Restarts the worker if it dies, or if
+    its heartbeat (shared with us) is older than the watchdog deadline. Reloads
+    its own configuration when the worker does, so its deadline stays current.
+ */
+int supervise(void)
+{
+    const kConfigurationOptions *options;
+    struct epoll_event  event;
+    unsigned long       deadline, age, sleepMs;
+    pid_t               pid;
+    int                 status, changed;
+    bool                aggregate;
+
+    gProcessName = "master";
+
+    /* a SIGHUP is for the worker too, but the master has to survive it first */
+    gConfigWatch = configWatch();
+
+    /* if asked, the worker logs via shared memory, and we do the writing */
+    aggregate = aggregateWorkers(false);
+
+    while (!gTerminating)
+    {
+        if (gWorker <= 0)
+        {
+            gWorker = spawnWorker(aggregate);
+        }
+
+        options  = configAcquire();
+        deadline = options->watchdog;
+        configRelease();
+
+        /* woken early by SIGCHLD, SIGHUP, or an edit to the config file */
+        sleepMs = (deadline != 0 && deadline < 4000 ? (deadline < 40 ? 10 : deadline / 4) : 1000);
+        if (sdWatchdogInterval() != 0 && sdWatchdogInterval() / 4 < sleepMs)
+        {
+            sleepMs = sdWatchdogInterval() / 4;
+        }
+        if (gConfigWatch >= 0)
+        {
+            epoll_wait(gConfigWatch, &event, 1, sleepMs);
+            changed = configChanged(gConfigWatch);
+        }
+        else
+        {
+            usleep(sleepMs * 1000);
+            changed = 0;
+        }
+
+        if (changed)
+        {
+            reloadConfiguration();
+            aggregate = aggregateWorkers(aggregate);
+
+            /* the worker notices edits to the file for itself, but not a SIGHUP sent to us */
+            if ((changed & kConfigSignalled) && gWorker > 0)
+            {
+                kill(gWorker, SIGHUP);
+            }
+        }
+
+        if (gChildExited)
+        {
+            gChildExited = 0;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                /* write out whatever it logged before it went */
+                logRingRelease(pid);
+
+                if (pid == gWorker)
+                {
+                    if (WIFSIGNALED(status))
+                    {
+                        logError("worker %d killed by signal %d, restarting it", pid, WTERMSIG(status));
+                    }
+                    else
+                    {
+                        logError("worker %d exited with status %d, restarting it", pid, WEXITSTATUS(status));
+                    }
+                    gWorker = 0;
+                }
+            }
+        }
+        else if (gWorker > 0 && deadline != 0 && (age = watchdogHeartbeatAge()) > 2 * deadline)
+        {
+            /* the worker's own watchdog has had a chance to log its stack, so put it out of its misery */
+            logCritical("worker %d has been hung for %lu ms, killing it", gWorker, age);
+            kill(gWorker, SIGKILL);
+        }
+
+        logShedPoll();
+
+        /* systemd's watchdog is only kept happy while the worker is getting somewhere */
+        if (gWorker > 0 && watchdogHeartbeatAge() < sdWatchdogInterval())
+        {
+            sdNotifyWatchdog();
+        }
+    }
+
+    if (gWorker > 0)
+    {
+        kill(gWorker, SIGTERM);
+        waitpid(gWorker, &status, 0);
+        logRingRelease(gWorker);
+    }
+    logRingStopCollector();
+
+    return 0;
+}
+
+
 /* Master's SIGCHLD handler.
  *
  * When a process is fork()ed by a process, the new process is an exact copy
@@ -231,6 +482,7 @@ int daemonize(bool inForeground)
  */
 void restartChildren(int UNUSED(signal))
 {
+    gChildExited = 1; /* supervise() does the waitpid() */
 }
 
 /* Master's kill switch
@@ -238,9 +490,14 @@ void restartChildren(int UNUSED(signal))
  * It's important to ensure that all children have exited before the master
  * exits so no root zombies are created. The default handler for SIGINT sends
  * SIGINT to all children, but this is not true with SIGTERM.
+ *
+ * Without a master (or in the worker), it's background() that has to stop, so
+ * main() can flush & close the log on its way out.
  */
 void terminateChildren(int UNUSED(signal))
 {
+    gTerminating = 1; /* supervise() passes it on to the worker */
+    backgroundStop();
 }
 
 /* suppress an (apparently) spurious warning */
@@ -263,6 +520,7 @@ static struct {
     },     /* Don't send SIGCHLD when a process has been frozen (e.g. Ctrl-Z) */
     { SIGINT,  { &terminateChildren } },
     { SIGTERM, { &terminateChildren } },
+    { SIGHUP,  { SIG_IGN } },   /* until configWatch traps it, so it can't kill us */
     { 0 } /* end of list */
 };
 #pragma GCC diagnostic pop
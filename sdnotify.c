@@ -0,0 +1,277 @@
+/*
+    The systemd service protocols, spoken directly.
+
+    Notifications are single datagrams to the unix socket named by
+    $NOTIFY_SOCKET - a path, or an abstract socket if it starts with '@'.
+    The socket is non-blocking: a notification dropped because systemd is
+    behind is better than stalling the background loop on it.
+
+    Socket activation passes $LISTEN_FDS already-listening sockets, starting
+    at fd 3, to the process named by $LISTEN_PID. Connections queue on them
+    from before we start, so nothing is refused while we get going.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stddef.h>     /* offsetof() */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sdnotify.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+static int                  gNotifyFd = -1;
+static struct sockaddr_un   gNotifyAddr;
+static socklen_t            gNotifyAddrLen = 0;
+
+static pid_t                gMainPid = 0;           /* the only process that pings the watchdog */
+static unsigned long long   gWatchdogNs = 0;        /* systemd's watchdog interval, 0 if it has none */
+static unsigned long long   gWatchdogPinged = 0;
+
+static int                  gListenFds = -1;        /* -1 until we've looked */
+static char *               gListenNames = NULL;    /* $LISTEN_FDNAMES, ':' separated */
+
+static unsigned long long nowNs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void sdNotifyInit( void )
+{
+    const char *socketPath;
+    const char *env;
+    size_t      len;
+
+    gMainPid = getpid();
+
+    socketPath = getenv( "NOTIFY_SOCKET" );
+    if ( socketPath != NULL && (socketPath[0] == '/' || socketPath[0] == '@') )
+    {
+        len = strlen( socketPath );
+        if ( len >= sizeof(gNotifyAddr.sun_path) )
+        {
+            logWarning( "NOTIFY_SOCKET \"%s\" is too long", socketPath );
+        }
+        else
+        {
+            memset( &gNotifyAddr, 0, sizeof(gNotifyAddr) );
+            gNotifyAddr.sun_family = AF_UNIX;
+            memcpy( gNotifyAddr.sun_path, socketPath, len );
+            if ( socketPath[0] == '@' )
+            {
+                gNotifyAddr.sun_path[0] = '\0';     /* abstract, so the length matters rather than a nul */
+            }
+            gNotifyAddrLen = offsetof( struct sockaddr_un, sun_path ) + len;
+
+            gNotifyFd = socket( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 );
+            if ( gNotifyFd < 0 )
+            {
+                logWarning( "unable to create the notify socket (%s [%d])", strerror(errno), errno );
+            }
+        }
+    }
+
+    /* only the process systemd started is being watched, not anything it forks */
+    env = getenv( "WATCHDOG_USEC" );
+    if ( env != NULL && gNotifyFd >= 0 )
+    {
+        const char *pid = getenv( "WATCHDOG_PID" );
+
+        if ( pid == NULL || strtol( pid, NULL, 10 ) == gMainPid )
+        {
+            gWatchdogNs = strtoull( env, NULL, 10 ) * 1000ULL;
+        }
+    }
+}
+
+int sdNotify( const char *state )
+{
+    if ( gNotifyFd < 0 )
+    {
+        return 0;
+    }
+
+    if ( sendto( gNotifyFd, state, strlen(state), MSG_NOSIGNAL,
+                 (struct sockaddr *)&gNotifyAddr, gNotifyAddrLen ) < 0 )
+    {
+        logWarning( "unable to notify systemd of \"%s\" (%s [%d])", state, strerror(errno), errno );
+        return errno;
+    }
+    return 0;
+}
+
+void sdNotifyMainPid( pid_t pid )
+{
+    char    state[32];
+
+    if ( pid != getpid() )
+    {
+        snprintf( state, sizeof(state), "MAINPID=%d", pid );
+        sdNotify( state );
+    }
+    gMainPid = pid;
+}
+
+void sdNotifyReady( const char *status )
+{
+    char    state[256];
+
+    if ( status != NULL )
+    {
+        snprintf( state, sizeof(state), "READY=1\nSTATUS=%s", status );
+        sdNotify( state );
+    }
+    else
+    {
+        sdNotify( "READY=1" );
+    }
+}
+
+void sdNotifyStopping( void )
+{
+    if ( getpid() == gMainPid )
+    {
+        sdNotify( "STOPPING=1" );
+    }
+}
+
+void sdNotifyWatchdog( void )
+{
+    unsigned long long now;
+
+    if ( gWatchdogNs != 0 && getpid() == gMainPid )
+    {
+        now = nowNs();
+        if ( now - gWatchdogPinged >= gWatchdogNs / 4 )
+        {
+            gWatchdogPinged = now;
+            sdNotify( "WATCHDOG=1" );
+        }
+    }
+}
+
+unsigned int sdWatchdogInterval( void )
+{
+    if ( getpid() != gMainPid )
+    {
+        return 0;
+    }
+    return gWatchdogNs / 1000000ULL;
+}
+
+int sdListenFds( void )
+{
+    const char *env;
+    struct stat st;
+    int         fd, flags;
+
+    if ( gListenFds >= 0 )
+    {
+        return gListenFds;
+    }
+    gListenFds = 0;
+
+    /* they're only for us if they were passed to this very process */
+    env = getenv( "LISTEN_PID" );
+    if ( env == NULL || strtol( env, NULL, 10 ) != getpid() )
+    {
+        return 0;
+    }
+
+    env = getenv( "LISTEN_FDS" );
+    if ( env != NULL )
+    {
+        gListenFds = strtol( env, NULL, 10 );
+        if ( gListenFds < 0 )
+        {
+            gListenFds = 0;
+        }
+    }
+
+    env = getenv( "LISTEN_FDNAMES" );
+    if ( env != NULL )
+    {
+        gListenNames = strdup( env );
+    }
+
+    /* don't leak them into anything we might exec */
+    for ( fd = kSdListenFdsStart; fd < kSdListenFdsStart + gListenFds; ++fd )
+    {
+        flags = fcntl( fd, F_GETFD );
+        if ( flags < 0 || fcntl( fd, F_SETFD, flags | FD_CLOEXEC ) < 0 )
+        {
+            logWarning( "passed fd %d is unusable (%s [%d])", fd, strerror(errno), errno );
+        }
+        else if ( fstat( fd, &st ) == 0 && !S_ISSOCK( st.st_mode ) )
+        {
+            logWarning( "passed fd %d isn't a socket", fd );
+        }
+    }
+
+    /* and don't let anything we fork think they were meant for it */
+    unsetenv( "LISTEN_PID" );
+    unsetenv( "LISTEN_FDS" );
+    unsetenv( "LISTEN_FDNAMES" );
+
+    if ( gListenFds > 0 )
+    {
+        logInfo( "adopted %d socket%s from systemd", gListenFds, gListenFds == 1 ? "" : "s" );
+    }
+    return gListenFds;
+}
+
+int sdListenFdByName( const char *name )
+{
+    const char *start, *end;
+    size_t      len;
+    int         i;
+
+    if ( sdListenFds() <= 0 || gListenNames == NULL )
+    {
+        return -1;
+    }
+
+    len   = strlen( name );
+    start = gListenNames;
+    for ( i = 0; i < gListenFds; ++i )
+    {
+        end = strchr( start, ':' );
+        if ( end == NULL )
+        {
+            end = start + strlen( start );
+        }
+        if ( (size_t)(end - start) == len && memcmp( start, name, len ) == 0 )
+        {
+            return kSdListenFdsStart + i;
+        }
+        if ( *end == '\0' )
+        {
+            break;
+        }
+        start = end + 1;
+    }
+    return -1;
+}
+
+#include "logging-epilogue.h"
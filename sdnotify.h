@@ -0,0 +1,51 @@
+#ifndef SDNOTIFY_H
+#define SDNOTIFY_H
+
+#include <sys/types.h>
+
+/*
+    The systemd service protocols, without needing libsystemd: readiness and
+    watchdog notifications over $NOTIFY_SOCKET, and sockets passed to us by
+    socket activation ($LISTEN_FDS). All of it does nothing when we weren't
+    started by systemd.
+
+    Use Type=notify, ideally with --foreground. When forking, the parent hands
+    over to the daemon process with MAINPID=. When supervising, it's the worker
+    that becomes ready, so the unit needs NotifyAccess=all.
+*/
+
+/* the first fd passed by socket activation */
+#define kSdListenFdsStart   3
+
+/* pick up the environment. Call once, early, before forking anything */
+void    sdNotifyInit( void );
+
+/* send one or more newline-separated VARIABLE=value assignments. 0 if sent or
+   there's no one to send them to, otherwise an errno */
+int     sdNotify( const char *state );
+
+/* the daemon's main process is now pid. Called on both sides of the fork: it
+   takes over the watchdog, and the parent tells systemd */
+void    sdNotifyMainPid( pid_t pid );
+
+/* READY=1, with status as the STATUS= line, if it's not NULL */
+void    sdNotifyReady( const char *status );
+
+/* STOPPING=1, from the main process */
+void    sdNotifyStopping( void );
+
+/* WATCHDOG=1, if systemd wants them and this is the main process. Call it as
+   often as you like - it only sends one every quarter interval */
+void    sdNotifyWatchdog( void );
+
+/* systemd's watchdog interval in ms, or 0 if it isn't watching this process */
+unsigned int    sdWatchdogInterval( void );
+
+/* adopt the sockets passed by socket activation. Returns how many there are,
+   numbered from kSdListenFdsStart. Only the first call looks at the environment */
+int     sdListenFds( void );
+
+/* the passed socket named (FileDescriptorName=) name, or -1 if there isn't one */
+int     sdListenFdByName( const char *name );
+
+#endif //SDNOTIFY_H
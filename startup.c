@@ -0,0 +1,110 @@
+/*
+    Startup phase timing.
+
+    Phases are just a name and the time they finished, so marking one is
+    cheap and safe before logging is up. Nothing is logged until we're ready,
+    by which point logging has its real configuration.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "startup.h"
+#include "sdnotify.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kMaxStartupPhases   16
+
+typedef struct {
+    const char *        name;
+    unsigned long long  finished;       /* CLOCK_MONOTONIC, in ns */
+} tStartupPhase;
+
+static unsigned long long   gStartupBegan = 0;
+static tStartupPhase        gStartupPhases[kMaxStartupPhases];
+static unsigned int         gStartupPhaseCount = 0;
+static int                  gStartupDone = 0;
+
+static unsigned long long nowNs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* as early as we can get control - after the dynamic linker, before main() */
+static void startupBegin( void ) __attribute__((constructor));
+
+static void startupBegin( void )
+{
+    gStartupBegan = nowNs();
+}
+
+void startupPhase( const char *name )
+{
+    if ( gStartupPhaseCount < kMaxStartupPhases )
+    {
+        gStartupPhases[gStartupPhaseCount].name     = name;
+        gStartupPhases[gStartupPhaseCount].finished = nowNs();
+        ++gStartupPhaseCount;
+    }
+}
+
+void startupRestart( void )
+{
+    gStartupBegan      = nowNs();
+    gStartupPhaseCount = 0;
+    gStartupDone       = 0;
+}
+
+void startupReady( void )
+{
+    char                line[512];
+    char                status[64];
+    unsigned long long  previous, total;
+    unsigned int        i;
+    int                 len;
+
+    if ( gStartupDone )
+    {
+        return;
+    }
+    gStartupDone = 1;
+
+    total = nowNs() - gStartupBegan;
+
+    len = 0;
+    previous = gStartupBegan;
+    for ( i = 0; i < gStartupPhaseCount && len < (int)sizeof(line); ++i )
+    {
+        len += snprintf( &line[len], sizeof(line) - len, "%s%s %.2f",
+                         i == 0 ? "" : ", ",
+                         gStartupPhases[i].name,
+                         (double)(gStartupPhases[i].finished - previous) / 1e6 );
+        previous = gStartupPhases[i].finished;
+    }
+    if ( len == 0 )
+    {
+        line[0] = '\0';
+    }
+
+    logInfo( "ready in %.2f ms (%s)", (double)total / 1e6, line );
+
+    snprintf( status, sizeof(status), "ready in %.2f ms", (double)total / 1e6 );
+    sdNotifyReady( status );
+}
+
+#include "logging-epilogue.h"
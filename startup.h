@@ -0,0 +1,19 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+/*
+    Where the time goes between exec() and being ready for work. Each phase
+    is timed from the end of the one before - the first from just before
+    main() - and the lot is logged once the background loop is running.
+*/
+
+/* the phase called name has just finished */
+void    startupPhase( const char *name );
+
+/* forget the phases so far, and start timing again from now. For a respawned worker */
+void    startupRestart( void );
+
+/* log how long each phase took, and tell systemd we're ready. Only the first call does anything */
+void    startupReady( void );
+
+#endif //STARTUP_H
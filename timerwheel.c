@@ -0,0 +1,515 @@
+/*
+    Hierarchical timing wheels.
+
+    The first level has a slot for each of the next 256 ticks. Each level
+    above it has 64 slots, each covering 64 times as many ticks as a slot in
+    the level below. A timer goes in the lowest level with room for it. Every
+    256 ticks, the next slot up is 'cascaded' - its timers are put back in,
+    which moves them down a level - and so on up the levels.
+
+    Slots are lists linked both ways, so a timer can be taken out without
+    looking for it, and each level keeps a bitmap of which slots have timers,
+    so finding the next thing to do is a few instructions rather than a walk.
+    Idle ticks are skipped rather than stepped through.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+#define kNearBits       8                       /* the first level: a slot per tick */
+#define kNearSlots      (1 << kNearBits)
+#define kFarBits        6                       /* the levels above it */
+#define kFarSlots       (1 << kFarBits)
+#define kFarLevels      4                       /* so the wheel covers 2^32 ticks */
+#define kNearLevel      kFarLevels              /* the 'level' of a timer in a near slot */
+#define kDetached       0xff                    /* ... and of one that's on its way to expiring */
+#define kTimersPerSlab  1024
+
+#define farShift(level) (kNearBits + (level) * kFarBits)   /* level 0 is the first one above the near slots */
+
+struct sTimer {
+    tTimer             *next;
+    tTimer            **pprev;          /* whatever points at this one */
+    unsigned long long  expires;        /* the tick it's due */
+    fpTimerExpired      expired;
+    void               *context;
+    unsigned char       level;          /* where it is, so its slot's bit can be cleared when it's emptied */
+    unsigned char       slot;
+};
+
+struct sTimerWheel {
+    unsigned int        resolution;     /* ms per tick */
+    unsigned long long  current;        /* the next tick to expire */
+    tTimer             *near[kNearSlots];
+    tTimer             *far[kFarLevels][kFarSlots];
+    uint64_t            nearUsed[kNearSlots / 64];
+    uint64_t            farUsed[kFarLevels];
+    tTimerWheelStats    stats;
+};
+
+static tTimer *         gFreeTimers = NULL;     /* the pool, linked through next */
+static size_t           gPooled = 0;
+
+
+/********** DO NOT INSTRUMENT THE SCHEDULER! **********/
+
+static unsigned long long nowMs( void )             __attribute__((no_instrument_function));
+static tTimer * timerAllocate( void )               __attribute__((no_instrument_function));
+static void timerFree( tTimer *timer )              __attribute__((no_instrument_function));
+static int  firstUsed( const uint64_t *bits, unsigned int count, unsigned int from )
+                                                    __attribute__((no_instrument_function));
+static void slotInsert( tTimerWheel *wheel, tTimer *timer )
+                                                    __attribute__((no_instrument_function));
+static void slotRemove( tTimerWheel *wheel, tTimer *timer )
+                                                    __attribute__((no_instrument_function));
+static tTimer * detach( tTimerWheel *wheel, unsigned int level, unsigned int slot )
+                                                    __attribute__((no_instrument_function));
+static void cascade( tTimerWheel *wheel )           __attribute__((no_instrument_function));
+static void moveTo( tTimerWheel *wheel, unsigned long long tick )
+                                                    __attribute__((no_instrument_function));
+static unsigned long long nextTick( const tTimerWheel *wheel )
+                                                    __attribute__((no_instrument_function));
+static unsigned long long deadline( const tTimerWheel *wheel, unsigned int ms )
+                                                    __attribute__((no_instrument_function));
+tTimer * timerStart( tTimerWheel *wheel, unsigned int ms, fpTimerExpired expired, void *context )
+                                                    __attribute__((no_instrument_function));
+void timerRestart( tTimerWheel *wheel, tTimer *timer, unsigned int ms )
+                                                    __attribute__((no_instrument_function));
+void timerCancel( tTimerWheel *wheel, tTimer *timer )
+                                                    __attribute__((no_instrument_function));
+int  timerWheelTimeout( const tTimerWheel *wheel )  __attribute__((no_instrument_function));
+unsigned int timerWheelAdvance( tTimerWheel *wheel )
+                                                    __attribute__((no_instrument_function));
+
+/********** DO NOT INSTRUMENT THE SCHEDULER! **********/
+
+
+static unsigned long long nowMs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/********** the pool **********/
+
+static tTimer * timerAllocate( void )
+{
+    tTimer          *slab, *timer;
+    unsigned int     i;
+
+    if ( gFreeTimers == NULL )
+    {
+        slab = malloc( kTimersPerSlab * sizeof(tTimer) );
+        if ( slab == NULL )
+        {
+            logError( "unable to allocate more timers (%s [%d])", strerror(errno), errno );
+            return NULL;
+        }
+        for ( i = 0; i < kTimersPerSlab - 1; ++i )
+        {
+            slab[i].next = &slab[i + 1];
+        }
+        slab[i].next = NULL;
+        gFreeTimers  = slab;
+        gPooled     += kTimersPerSlab * sizeof(tTimer);
+    }
+
+    timer       = gFreeTimers;
+    gFreeTimers = timer->next;
+    return timer;
+}
+
+static void timerFree( tTimer *timer )
+{
+    timer->next = gFreeTimers;
+    gFreeTimers = timer;
+}
+
+/********** slots **********/
+
+/* the first slot at or after from with a timer in it, or -1 */
+static int firstUsed( const uint64_t *bits, unsigned int count, unsigned int from )
+{
+    unsigned int    word;
+    uint64_t        used;
+
+    for ( word = from / 64; from < count; from = ++word * 64 )
+    {
+        used = bits[word] & (~0ULL << (from % 64));
+        if ( used != 0 )
+        {
+            return word * 64 + __builtin_ctzll( used );
+        }
+    }
+    return -1;
+}
+
+/* put a timer in the slot for its tick, relative to where the wheel's got to */
+static void slotInsert( tTimerWheel *wheel, tTimer *timer )
+{
+    unsigned long long  expires, delta;
+    tTimer            **head;
+    unsigned int        level;
+
+    expires = (timer->expires > wheel->current) ? timer->expires : wheel->current;
+    delta   = expires - wheel->current;
+
+    if ( delta < kNearSlots )
+    {
+        timer->level = kNearLevel;
+        timer->slot  = expires % kNearSlots;
+        head = &wheel->near[timer->slot];
+        wheel->nearUsed[timer->slot / 64] |= 1ULL << (timer->slot % 64);
+    }
+    else
+    {
+        for ( level = 0; level < kFarLevels - 1 && delta >= (1ULL << farShift( level + 1 )); ++level )
+        { /* find the lowest level with room for it */ }
+
+        if ( delta >= (1ULL << farShift( kFarLevels )) )
+        {
+            /* further out than the wheel goes - park it as far away as it can, it'll come round again */
+            expires = wheel->current + (1ULL << farShift( kFarLevels )) - 1;
+        }
+        timer->level = level;
+        timer->slot  = (expires >> farShift( level )) % kFarSlots;
+        head = &wheel->far[level][timer->slot];
+        wheel->farUsed[level] |= 1ULL << timer->slot;
+    }
+
+    timer->next = *head;
+    if ( timer->next != NULL )
+    {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void slotRemove( tTimerWheel *wheel, tTimer *timer )
+{
+    *timer->pprev = timer->next;
+    if ( timer->next != NULL )
+    {
+        timer->next->pprev = timer->pprev;
+    }
+
+    if ( timer->level == kNearLevel )
+    {
+        if ( wheel->near[timer->slot] == NULL )
+        {
+            wheel->nearUsed[timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+        }
+    }
+    else if ( timer->level < kFarLevels )
+    {
+        if ( wheel->far[timer->level][timer->slot] == NULL )
+        {
+            wheel->farUsed[timer->level] &= ~(1ULL << timer->slot);
+        }
+    }
+}
+
+/* empty a slot, returning what was in it */
+static tTimer * detach( tTimerWheel *wheel, unsigned int level, unsigned int slot )
+{
+    tTimer     *list;
+
+    if ( level == kNearLevel )
+    {
+        list = wheel->near[slot];
+        wheel->near[slot] = NULL;
+        wheel->nearUsed[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    else
+    {
+        list = wheel->far[level][slot];
+        wheel->far[level][slot] = NULL;
+        wheel->farUsed[level] &= ~(1ULL << slot);
+    }
+    return list;
+}
+
+/* the near slots have just come round again, so move the next lot down from the levels above */
+static void cascade( tTimerWheel *wheel )
+{
+    tTimer         *timer, *next;
+    unsigned int    level, slot;
+
+    for ( level = 0; level < kFarLevels; ++level )
+    {
+        slot = (wheel->current >> farShift( level )) % kFarSlots;
+        for ( timer = detach( wheel, level, slot ); timer != NULL; timer = next )
+        {
+            next = timer->next;
+            slotInsert( wheel, timer );
+            ++wheel->stats.cascaded;
+        }
+        if ( slot != 0 )
+        {
+            break; /* the level above hasn't come round yet */
+        }
+    }
+}
+
+static void moveTo( tTimerWheel *wheel, unsigned long long tick )
+{
+    wheel->current = tick;
+    if ( tick % kNearSlots == 0 )
+    {
+        cascade( wheel );
+    }
+}
+
+/*
+    The first tick with anything to do: a near slot to expire, or a slot
+    further out to cascade. Nothing can be due before the slot it's in is
+    cascaded, so it's never later than the next expiry, and all the ticks
+    before it can be skipped. ULLONG_MAX if the wheel is empty.
+*/
+static unsigned long long nextTick( const tTimerWheel *wheel )
+{
+    unsigned long long  next, boundary;
+    unsigned int        index, level;
+    int                 slot;
+
+    /* the first near slot that's in use, going round from the current one */
+    next  = ULLONG_MAX;
+    index = wheel->current % kNearSlots;
+    slot  = firstUsed( wheel->nearUsed, kNearSlots, index );
+    if ( slot >= 0 )
+    {
+        next = wheel->current + (slot - index);
+    }
+    else if ( (slot = firstUsed( wheel->nearUsed, kNearSlots, 0 )) >= 0 )
+    {
+        next = wheel->current + kNearSlots - index + slot;
+    }
+
+    for ( level = 0; level < kFarLevels; ++level )
+    {
+        if ( wheel->farUsed[level] == 0 )
+        {
+            continue;
+        }
+        /* the current slot at each level has already been cascaded, so start with the one after */
+        index = (wheel->current >> farShift( level )) % kFarSlots;
+        slot  = firstUsed( &wheel->farUsed[level], kFarSlots, index + 1 );
+        if ( slot < 0 )
+        {
+            slot = firstUsed( &wheel->farUsed[level], kFarSlots, 0 ) + kFarSlots;
+        }
+        boundary = ((wheel->current >> farShift( level )) + (slot - index)) << farShift( level );
+        if ( boundary < next )
+        {
+            next = boundary;
+        }
+    }
+    return next;
+}
+
+/* the tick ms from now falls in, rounded up so nothing expires early */
+static unsigned long long deadline( const tTimerWheel *wheel, unsigned int ms )
+{
+    return (nowMs() + ms + wheel->resolution - 1) / wheel->resolution;
+}
+
+/********** the public face **********/
+
+tTimerWheel * timerWheelCreate( unsigned int resolution )
+{
+    tTimerWheel     *wheel;
+
+    if ( resolution == 0 )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    wheel = calloc( 1, sizeof(tTimerWheel) );
+    if ( wheel != NULL )
+    {
+        wheel->resolution = resolution;
+        wheel->current    = nowMs() / resolution;
+    }
+    return wheel;
+}
+
+void timerWheelDestroy( tTimerWheel *wheel )
+{
+    tTimer         *timer;
+    unsigned int    level, slot;
+
+    if ( wheel == NULL )
+    {
+        return;
+    }
+
+    for ( slot = 0; slot < kNearSlots; ++slot )
+    {
+        while ( (timer = wheel->near[slot]) != NULL )
+        {
+            wheel->near[slot] = timer->next;
+            timerFree( timer );
+        }
+    }
+    for ( level = 0; level < kFarLevels; ++level )
+    {
+        for ( slot = 0; slot < kFarSlots; ++slot )
+        {
+            while ( (timer = wheel->far[level][slot]) != NULL )
+            {
+                wheel->far[level][slot] = timer->next;
+                timerFree( timer );
+            }
+        }
+    }
+    free( wheel );
+}
+
+tTimer * timerStart( tTimerWheel *wheel, unsigned int ms, fpTimerExpired expired, void *context )
+{
+    tTimer      *timer;
+
+    timer = timerAllocate();
+    if ( timer == NULL )
+    {
+        return NULL;
+    }
+
+    if ( wheel->stats.pending == 0 && wheel->current < nowMs() / wheel->resolution )
+    {
+        /* nothing to cascade, so catch up with the clock in one go */
+        wheel->current = nowMs() / wheel->resolution;
+    }
+
+    timer->expires = deadline( wheel, ms );
+    timer->expired = expired;
+    timer->context = context;
+    slotInsert( wheel, timer );
+
+    ++wheel->stats.started;
+    ++wheel->stats.pending;
+    return timer;
+}
+
+void timerRestart( tTimerWheel *wheel, tTimer *timer, unsigned int ms )
+{
+    slotRemove( wheel, timer );
+    timer->expires = deadline( wheel, ms );
+    slotInsert( wheel, timer );
+}
+
+void timerCancel( tTimerWheel *wheel, tTimer *timer )
+{
+    if ( timer != NULL )
+    {
+        slotRemove( wheel, timer );
+        timerFree( timer );
+
+        ++wheel->stats.cancelled;
+        --wheel->stats.pending;
+    }
+}
+
+int timerWheelTimeout( const tTimerWheel *wheel )
+{
+    unsigned long long  next, now;
+
+    if ( wheel->stats.pending == 0 )
+    {
+        return -1;
+    }
+
+    next = nextTick( wheel );
+    now  = nowMs();
+    if ( next * wheel->resolution <= now )
+    {
+        return 0;
+    }
+    if ( next * wheel->resolution - now > INT_MAX )
+    {
+        return INT_MAX;
+    }
+    return next * wheel->resolution - now;
+}
+
+unsigned int timerWheelAdvance( tTimerWheel *wheel )
+{
+    unsigned long long  target, next;
+    tTimer             *due, *timer;
+    fpTimerExpired      expired;
+    void               *context;
+    unsigned int        count = 0, index;
+
+    target = nowMs() / wheel->resolution;
+    if ( wheel->stats.pending == 0 && wheel->current <= target )
+    {
+        wheel->current = target + 1; /* nothing to cascade */
+    }
+    while ( wheel->current <= target )
+    {
+        index = wheel->current % kNearSlots;
+        if ( wheel->near[index] == NULL )
+        {
+            /* skip straight to the next tick with something to do */
+            next = nextTick( wheel );
+            moveTo( wheel, (next <= target) ? next : target + 1 );
+            continue;
+        }
+
+        /* take the whole slot, so anything started from expired doesn't land in it part way through */
+        due = detach( wheel, kNearLevel, index );
+        due->pprev = &due;
+        for ( timer = due; timer != NULL; timer = timer->next )
+        {
+            timer->level = kDetached;
+        }
+        moveTo( wheel, wheel->current + 1 );
+
+        while ( (timer = due) != NULL )
+        {
+            slotRemove( wheel, timer );
+            expired = timer->expired;
+            context = timer->context;
+            timerFree( timer );
+
+            ++wheel->stats.expired;
+            --wheel->stats.pending;
+            ++count;
+
+            expired( context );
+        }
+    }
+    return count;
+}
+
+void timerWheelStats( const tTimerWheel *wheel, tTimerWheelStats *stats )
+{
+    *stats = wheel->stats;
+    stats->pooled = gPooled;
+}
+
+#include "logging-epilogue.h"
@@ -0,0 +1,63 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+
+/*
+    Hierarchical timing wheels, for lots of timers: timeouts, retries, leases.
+
+    Starting, restarting and cancelling a timer are O(1), whatever the number
+    of timers, and everything due on the same tick expires as one batch. A
+    wheel ticks every 'resolution' ms - 1 for fine timeouts, seconds for
+    leases - and covers about 2^32 ticks, beyond which timers just go round
+    again. Timers never expire early, but may be up to a tick late.
+
+    A wheel doesn't have a kernel timer of its own. Whatever drives it waits
+    for timerWheelTimeout() ms (e.g. as its epoll_wait() timeout), then calls
+    timerWheelAdvance(). The coroutine scheduler does this for its own wheel;
+    a coarser one can be driven by a coroutine that sleeps on that.
+
+    Timer nodes come from a pool shared by every wheel in the process. None of
+    this is thread safe: use a wheel from one thread.
+*/
+
+typedef struct sTimerWheel  tTimerWheel;
+typedef struct sTimer       tTimer;
+
+typedef void (*fpTimerExpired)( void *context );
+
+/* counters for tuning */
+typedef struct {
+    unsigned int        pending;        /* started and not yet expired or cancelled */
+    unsigned long       started;
+    unsigned long       expired;
+    unsigned long       cancelled;
+    unsigned long       cascaded;       /* times a timer moved down a level on its way to expiring */
+    size_t              pooled;         /* bytes of timer nodes, for the whole process */
+} tTimerWheelStats;
+
+/* a wheel that ticks every resolution ms. NULL on failure */
+tTimerWheel *   timerWheelCreate( unsigned int resolution );
+
+/* free the wheel, and cancel everything on it without calling anything */
+void    timerWheelDestroy( tTimerWheel *wheel );
+
+/* call expired(context) in ms time. The handle is valid until expired is called
+   (not during) or until it's cancelled. NULL on failure */
+tTimer *    timerStart( tTimerWheel *wheel, unsigned int ms, fpTimerExpired expired, void *context );
+
+/* push a pending timer back to ms from now, e.g. when a lease is renewed */
+void    timerRestart( tTimerWheel *wheel, tTimer *timer, unsigned int ms );
+
+/* forget a pending timer. NULL is ignored */
+void    timerCancel( tTimerWheel *wheel, tTimer *timer );
+
+/* ms until the wheel next needs advancing: 0 if it's overdue, -1 if it has nothing pending */
+int     timerWheelTimeout( const tTimerWheel *wheel );
+
+/* expire everything that's due, in order of tick. Returns how many expired */
+unsigned int    timerWheelAdvance( tTimerWheel *wheel );
+
+void    timerWheelStats( const tTimerWheel *wheel, tTimerWheelStats *stats );
+
+#endif //TIMERWHEEL_H
@@ -0,0 +1,255 @@
+/*
+    Event loop stall watchdog.
+
+    The background loop bumps a heartbeat every time around. A watchdog thread
+    checks it against the configured deadline, and when the loop misses it,
+    signals the stuck thread to capture its own backtrace, then logs it.
+
+    The heartbeat lives in shared memory, so a supervising master process can
+    watch its workers' heartbeat too.
+*/
+
+#define  _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <execinfo.h>   /* backtrace() */
+#include <sys/mman.h>
+
+#include "watchdog.h"
+#include "config.h"
+
+#include "logging.h"    /* our logging support */
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+/* the signal used to ask the stuck thread for its backtrace */
+#define kWatchdogSignal     SIGUSR2
+#define kMaxStallFrames     32
+
+typedef struct {
+    atomic_ulong        beats;          /* bumped every time around the loop */
+    atomic_ullong       lastBeat;       /* CLOCK_MONOTONIC, in ns */
+} tHeartbeat;
+
+/* upper bound of each stall duration bucket, in ms. The last bucket catches the rest */
+static const unsigned long kStallBucketMs[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 30000 };
+#define kStallBuckets   (sizeof(kStallBucketMs) / sizeof(kStallBucketMs[0]) + 1)
+
+static tHeartbeat *     gHeartbeat = NULL;
+static atomic_ulong     gStalls[kStallBuckets];
+
+static pthread_t        gWatched;
+static pthread_t        gWatchdog;
+
+/* filled in by the stuck thread, from inside the signal handler */
+static void *           gStallFrames[kMaxStallFrames];
+static atomic_int       gStallFrameCount = 0;
+
+
+static unsigned long long nowNs( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int watchdogInit( void )
+{
+    gHeartbeat = mmap( NULL, sizeof(tHeartbeat), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( gHeartbeat == MAP_FAILED )
+    {
+        gHeartbeat = NULL;
+        logError( "unable to map the heartbeat (%s [%d])", strerror(errno), errno );
+        return errno;
+    }
+
+    atomic_store( &gHeartbeat->beats, 0 );
+    atomic_store( &gHeartbeat->lastBeat, nowNs() );
+
+    return 0;
+}
+
+void watchdogHeartbeat( void )
+{
+    if ( gHeartbeat != NULL )
+    {
+        atomic_fetch_add_explicit( &gHeartbeat->beats, 1, memory_order_relaxed );
+        atomic_store_explicit( &gHeartbeat->lastBeat, nowNs(), memory_order_release );
+    }
+}
+
+unsigned long watchdogHeartbeatAge( void )
+{
+    if ( gHeartbeat == NULL )
+    {
+        return 0;
+    }
+    return (nowNs() - atomic_load_explicit( &gHeartbeat->lastBeat, memory_order_acquire )) / 1000000UL;
+}
+
+void watchdogLogStalls( void )
+{
+    unsigned int i;
+
+    for ( i = 0; i < kStallBuckets; ++i )
+    {
+        if ( i < kStallBuckets - 1 )
+        {
+            logNotice( "stalls under %5lu ms: %lu", kStallBucketMs[i], atomic_load( &gStalls[i] ) );
+        }
+        else
+        {
+            logNotice( "stalls over  %5lu ms: %lu", kStallBucketMs[i - 1], atomic_load( &gStalls[i] ) );
+        }
+    }
+}
+
+static void countStall( unsigned long durationMs )
+{
+    unsigned int i;
+
+    for ( i = 0; i < kStallBuckets - 1 && durationMs >= kStallBucketMs[i]; ++i )
+    { /* find the bucket */ }
+
+    atomic_fetch_add( &gStalls[i], 1 );
+}
+
+/* runs on the stuck thread. backtrace() was primed in watchdogStart, so it won't allocate here */
+static void captureStack( int UNUSED(signal) )
+{
+    int saved = errno;
+
+    atomic_store( &gStallFrameCount, backtrace( gStallFrames, kMaxStallFrames ) );
+    errno = saved;
+}
+
+static void logStack( unsigned long ageMs )
+{
+    char    scratch[24];
+    int     i, count;
+
+    atomic_store( &gStallFrameCount, 0 );
+    if ( pthread_kill( gWatched, kWatchdogSignal ) != 0 )
+    {
+        logCritical( "background loop stalled for %lu ms, unable to capture its stack", ageMs );
+        return;
+    }
+
+    /* give it a moment to respond - it may be stuck in a syscall */
+    for ( i = 0; i < 100 && (count = atomic_load( &gStallFrameCount )) == 0; ++i )
+    {
+        usleep( 1000 );
+    }
+
+    logCritical( "background loop stalled for %lu ms", ageMs );
+
+    /* skip the signal handler's own frames */
+    for ( i = 2; i < count; ++i )
+    {
+        logCritical( "  #%-2d %s()", i - 2, addrToString( gStallFrames[i], scratch ) );
+    }
+}
+
+static void * watchdogThread( void * UNUSED(arg) )
+{
+    const kConfigurationOptions *options;
+    unsigned long       deadline, beats, stalledBeats, ageMs;
+    unsigned long long  stalledSince;
+    int                 stalled;
+
+    stalled      = 0;
+    stalledBeats = 0;
+    stalledSince = 0;
+
+    while (1)
+    {
+        /* pick up the deadline each time around, so a reload can change it */
+        options  = configAcquire();
+        deadline = options->watchdog;
+        configRelease();
+
+        usleep( (deadline != 0 && deadline < 4000 ? (deadline < 40 ? 10 : deadline / 4) : 1000) * 1000 );
+
+        beats = atomic_load( &gHeartbeat->beats );
+
+        if ( stalled && beats != stalledBeats )
+        { /* the loop has started moving again */
+            ageMs = (atomic_load( &gHeartbeat->lastBeat ) - stalledSince) / 1000000UL;
+            countStall( ageMs );
+            logWarning( "background loop resumed after %lu ms", ageMs );
+            stalled = 0;
+        }
+
+        if ( !stalled && deadline != 0 && (ageMs = watchdogHeartbeatAge()) > deadline )
+        {
+            stalled      = 1;
+            stalledBeats = beats;
+            stalledSince = atomic_load( &gHeartbeat->lastBeat );
+            logStack( ageMs );
+        }
+    }
+
+    return NULL;
+}
+
+int watchdogStart( void )
+{
+    struct sigaction    action;
+    sigset_t            all, previous;
+    void               *prime[1];
+    int                 result;
+
+    if ( gHeartbeat == NULL && watchdogInit() != 0 )
+    {
+        return -1;
+    }
+
+    /* the first call to backtrace() may load libgcc, which isn't safe in a signal handler */
+    backtrace( prime, 1 );
+
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = &captureStack;
+    action.sa_flags   = SA_RESTART | SA_ONSTACK;  /* spare small coroutine stacks, if there's an alternate one */
+    sigemptyset( &action.sa_mask );
+    if ( sigaction( kWatchdogSignal, &action, NULL ) < 0 )
+    {
+        logError( "unable to trap the watchdog signal (%s [%d])", strerror(errno), errno );
+        return errno;
+    }
+
+    gWatched = pthread_self();
+    watchdogHeartbeat();
+
+    /* the watchdog thread shouldn't field any of the process's signals */
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &previous );
+    result = pthread_create( &gWatchdog, NULL, &watchdogThread, NULL );
+    pthread_sigmask( SIG_SETMASK, &previous, NULL );
+
+    if ( result != 0 )
+    {
+        logError( "unable to start the watchdog thread (%s [%d])", strerror(result), result );
+        return result;
+    }
+    pthread_detach( gWatchdog );
+
+    return 0;
+}
+
+#include "logging-epilogue.h"
@@ -0,0 +1,19 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+/* map the heartbeat into shared memory. Call before forking, so workers share it with the master */
+int     watchdogInit( void );
+
+/* start a watchdog thread that monitors the calling thread's heartbeat */
+int     watchdogStart( void );
+
+/* bumped once per iteration of the background loop */
+void    watchdogHeartbeat( void );
+
+/* milliseconds since the last heartbeat, from any process sharing it */
+unsigned long   watchdogHeartbeatAge( void );
+
+/* log how many stalls we've seen, by duration */
+void    watchdogLogStalls( void );
+
+#endif //WATCHDOG_H